@@ -37,13 +37,14 @@ void trim(char *s){
 
 int main(int argc, char **argv){
 	DynamicArray <char> name(100), exon(100);
-	IO::FileReader f(argv[1]);
+	IO::FileReader *f = IO::newFileReader(argv[1]);
 	while (1){
-		if (IO::readLine(f, name) == EOF) break;
-		if (IO::readLine(f, exon) == EOF) break;
+		if (IO::readLine(*f, name) == EOF) break;
+		if (IO::readLine(*f, exon) == EOF) break;
 		trim(exon.data());
 		Exon[name.data()] = exon.data();
 	}
+	delete f;
 	for (map <string, string>::iterator it = Exon.begin(); it != Exon.end(); it ++){
 		puts(it -> first.c_str());
 		puts(it -> second.c_str());
@@ -28,12 +28,12 @@ void trim(char *s){
 
 int main(int argc, char **argv){
 	DynamicArray <char> name(100), read(100), sign(100), quality(100);
-	IO::FileReader f(argv[1]);
+	IO::FileReader *f = IO::newFileReader(argv[1]);
 	while (1){
-		if (IO::readLine(f, name) == EOF) break;
-		if (IO::readLine(f, read) == EOF) break;
-		if (IO::readLine(f, sign) == EOF) break;
-		if (IO::readLine(f, quality) == EOF) break;
+		if (IO::readLine(*f, name) == EOF) break;
+		if (IO::readLine(*f, read) == EOF) break;
+		if (IO::readLine(*f, sign) == EOF) break;
+		if (IO::readLine(*f, quality) == EOF) break;
 		trim(name.data());
 		trim(read.data());
 		unsigned len = std::min(strlen(quality.data()), strlen(read.data()));
@@ -43,5 +43,6 @@ int main(int argc, char **argv){
 		puts(read.data());
 		puts(quality.data());
 	}
+	delete f;
 	return 0;
 }
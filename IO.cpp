@@ -20,11 +20,18 @@
 #include <cstdio>
 #include <cstdlib>
 #include <signal.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <errno.h>
 
 #include "IO.h"
 #include "String.h"
 
 #define MIN_VALID_LEN 16
+#define WRITE_VECTOR_SIZE 64
 
 /*
 * Static functions
@@ -59,6 +66,18 @@ int IO::FileReader::nextChar(){
 	return fgetc(_f);
 }
 
+int IO::FileReader::peekChar(){
+	int c = fgetc(_f);
+	if (c != EOF) ungetc(c, _f);
+	return c;
+}
+
+const char *IO::FileReader::nextBlock(unsigned size){
+	if (size > _block.size()) _block.resize(size);
+	if (fread(_block.data(), 1, size, _f) < size) return 0;
+	return _block.data();
+}
+
 int IO::FileReader::readLine(DynamicArray <char> &ret){
 	int size = 0, c = '\n';
 	for (; c == '\n'; c = fgetc(_f));
@@ -72,25 +91,133 @@ int IO::FileReader::readLine(DynamicArray <char> &ret){
 	return size;
 }
 
+/*
+* A read is its name, DNA and quality lines, as BufferedFileReader reads them
+*/
 std::pair <int, int> IO::FileReader::readExon(DynamicArray <char> &name, DynamicArray <char> &dna, DynamicArray <char> &quality){
+	int nameSize = readLine(name), dnaSize;
+	if (nameSize == EOF || (dnaSize = readLine(dna)) == EOF || readLine(quality) == EOF) return std::make_pair(EOF, EOF);
+	String::dnaFormat(dna);
+	return std::make_pair(nameSize, dnaSize);
+}
+
+bool IO::FileReader::readRecord(Record &record){
+	std::pair <int, int> size = readExon(_recordName, _recordDna, _recordQuality);
+	if (size.first == EOF) return 0;
+	record.name = _recordName.data();
+	record.nameSize = size.first;
+	record.dna = _recordDna.data();
+	record.dnaSize = size.second;
+	record.quality = _recordQuality.data();
+	record.qualitySize = strlen(_recordQuality.data());
+	return 1;
 }
 
 /*
-* Class IO::BufferedFileReader::Buffer
+* Class IO::MappedFileReader
 */
-IO::BufferedFileReader::Buffer::Buffer(FILE* f) :  _next(0){
-	_size = fread(_data, 1, READ_BUFFER_SIZE, f);
+IO::MappedFileReader::MappedFileReader(const char *fileName) : FileReader(fileName), _data(0), _size(0), _loc(0), _isMapped(0){
+	if (!isOpen()) return;
+	struct stat st;
+	if (fstat(fileno(_f), &st) || !S_ISREG(st.st_mode)) return;
+	if (st.st_size){
+		void *data = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fileno(_f), 0);
+		if (data == MAP_FAILED) return;
+		madvise(data, st.st_size, MADV_SEQUENTIAL);
+		_data = (const char *)data;
+		_size = st.st_size;
+	}
+	_isMapped = 1;
+}
+
+IO::MappedFileReader::~MappedFileReader(){
+	if (_data) munmap((void *)_data, _size);
+}
+
+IO::MappedFileReader *IO::MappedFileReader::newMappedFileReader(const char *fileName){
+	MappedFileReader *ret = new MappedFileReader(fileName);
+	if (!ret -> _isMapped){
+		delete ret;
+		return 0;
+	}
+	return ret;
+}
+
+int IO::MappedFileReader::nextChar(){
+	if (_loc >= _size) return EOF;
+	return (unsigned char)_data[_loc ++];
+}
+
+int IO::MappedFileReader::peekChar(){
+	if (_loc >= _size) return EOF;
+	return (unsigned char)_data[_loc];
+}
+
+const char *IO::MappedFileReader::nextBlock(unsigned size){
+	if (_size - _loc < size) return 0;
+	const char *ret = _data + _loc;
+	_loc += size;
+	return ret;
+}
+
+int IO::MappedFileReader::nextLine(const char *&line){
+	if (_loc >= _size) return EOF;
+	line = _data + _loc;
+	const char *end = String::findChar(line, _data + _size, '\n');
+	_loc = end - _data + 1;
+	return end - line;
+}
+
+/*
+* Same as BufferedFileReader::readLine(), empty lines are returned as well
+*/
+int IO::MappedFileReader::readLine(DynamicArray <char> &ret){
+	const char *line;
+	int size = nextLine(line);
+	if (size == EOF) return EOF;
+	if (size >= ret.size()) ret.resize(size + 1);
+	memcpy(ret.data(), line, size);
+	ret[size] = 0;
+	return size;
+}
+
+std::pair <int, int> IO::MappedFileReader::readExon(DynamicArray <char> &name, DynamicArray <char> &dna, DynamicArray <char> &quality){
+	Record record;
+	if (!readRecord(record)) return std::make_pair(EOF, EOF);
+	if (record.nameSize >= name.size()) name.resize(record.nameSize + 1);
+	if (record.dnaSize >= dna.size()) dna.resize(record.dnaSize + 1);
+	if (record.qualitySize >= quality.size()) quality.resize(record.qualitySize + 1);
+	memcpy(name.data(), record.name, record.nameSize); name[record.nameSize] = 0;
+	memcpy(dna.data(), record.dna, record.dnaSize); dna[record.dnaSize] = 0;
+	memcpy(quality.data(), record.quality, record.qualitySize); quality[record.qualitySize] = 0;
+	String::dnaFormat(dna);
+	return std::make_pair(record.nameSize, record.dnaSize);
 }
 
-IO::BufferedFileReader::Buffer::~Buffer(){
+/*
+* Empty lines between the lines of a record are skipped, as in BufferedFileReader::readExon()
+*/
+bool IO::MappedFileReader::readRecord(Record &record){
+	if ((record.nameSize = nextNonEmptyLine_p(record.name)) == EOF) return 0;
+	if ((record.dnaSize = nextNonEmptyLine_p(record.dna)) == EOF) return 0;
+	if ((record.qualitySize = nextNonEmptyLine_p(record.quality)) == EOF) return 0;
+	return 1;
+}
+
+int IO::MappedFileReader::nextNonEmptyLine_p(const char *&line){
+	int ret;
+	while ((ret = nextLine(line)) == 0);
+	return ret;
 }
 
-IO::BufferedFileReader::Buffer* IO::BufferedFileReader::Buffer::next() const{
-	return _next;
+/*
+* Class IO::BufferedFileReader::Buffer
+*/
+IO::BufferedFileReader::Buffer::Buffer() : _size(0){
 }
 
-void IO::BufferedFileReader::Buffer::setNext(IO::BufferedFileReader::Buffer* next){
-	_next = next;
+void IO::BufferedFileReader::Buffer::fill(FILE *f){
+	_size = fread(_data, 1, READ_BUFFER_SIZE, f);
 }
 
 int IO::BufferedFileReader::Buffer::size() const{
@@ -101,6 +228,10 @@ char IO::BufferedFileReader::Buffer::operator[](int x) const{
 	return _data[x];
 }
 
+const char *IO::BufferedFileReader::Buffer::data() const{
+	return _data;
+}
+
 
 /*
 * Class IO::BufferedFileReader
@@ -112,25 +243,70 @@ IO::BufferedFileReader* IO::BufferedFileReader::newBufferedFileReader(const char
 		pthread_attr_init(&attr);
 		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
 		pthread_create(&ret -> _readThread, &attr, readingProcess, (void *)ret);
+		pthread_attr_destroy(&attr);
+		ret -> _isReading = 1;
 	}
 	return ret;
 }
 
 IO::BufferedFileReader::~BufferedFileReader(){
-	Buffer *next;
-	for (Buffer *p = _currentBuffer; p; p = next){
-		next = p -> next();
-		delete p;
-	}
-	
+	pthread_mutex_lock(&_ringMutex);
 	_isToQuit = 1;
-	pthread_cond_signal(&_fileReadPCondition);
+	pthread_cond_signal(&_notFullCondition);
+	pthread_mutex_unlock(&_ringMutex);
+	if (_isReading) pthread_join(_readThread, NULL);
+	delete[] _buffers;
 	
-	pthread_cond_destroy(&_fileReadPCondition);
-	pthread_mutex_destroy(&_fileReadPMutex);
+	pthread_cond_destroy(&_notEmptyCondition);
+	pthread_cond_destroy(&_notFullCondition);
+	pthread_mutex_destroy(&_ringMutex);
 	pthread_mutex_destroy(&_bufferReadPMutex);
 }
 
+int IO::BufferedFileReader::nextChar(){
+	pthread_mutex_lock(&_bufferReadPMutex);
+	int c = nextChar_p();
+	pthread_mutex_unlock(&_bufferReadPMutex);
+	return c;
+}
+
+int IO::BufferedFileReader::peekChar(){
+	pthread_mutex_lock(&_bufferReadPMutex);
+	while (_currentBuffer && _currentBufferLoc >= _currentBuffer -> size()) nextBuffer_p();
+	int c = _currentBuffer ? (unsigned char)(*_currentBuffer)[_currentBufferLoc] : EOF;
+	pthread_mutex_unlock(&_bufferReadPMutex);
+	return c;
+}
+
+/*
+* The block is copied out of the ring, it may span several buffers
+*/
+const char *IO::BufferedFileReader::nextBlock(unsigned size){
+	if (size > _block.size()) _block.resize(size);
+	unsigned loc = 0;
+	pthread_mutex_lock(&_bufferReadPMutex);
+	while (loc < size && _currentBuffer){
+		if (_currentBufferLoc >= _currentBuffer -> size()){
+			nextBuffer_p();
+			continue;
+		}
+		unsigned count = std::min(size - loc, (unsigned)_currentBuffer -> size() - _currentBufferLoc);
+		memcpy(_block.data() + loc, _currentBuffer -> data() + _currentBufferLoc, count);
+		loc += count;
+		_currentBufferLoc += count;
+	}
+	pthread_mutex_unlock(&_bufferReadPMutex);
+	return loc < size ? 0 : _block.data();
+}
+
+unsigned long IO::BufferedFileReader::callerStallCount() const{
+	return _callerStallCount;
+}
+
+unsigned long IO::BufferedFileReader::ioThreadStallCount() const{
+	return _ioThreadStallCount;
+}
+
 int IO::BufferedFileReader::readLine(DynamicArray <char> &ret){
 	int size = 0;
 	pthread_mutex_lock(&_bufferReadPMutex);
@@ -140,9 +316,10 @@ int IO::BufferedFileReader::readLine(DynamicArray <char> &ret){
 		pthread_mutex_unlock(&_bufferReadPMutex);
 		return EOF;
 	}
-	for (; c != '\n' && c != EOF; c = nextChar_p()){
+	if (c != '\n'){
 		if (size >= ret.size()) ret.expand();
 		ret[size ++] = c;
+		size = appendLine_p(ret, size);
 	}
 	pthread_mutex_unlock(&_bufferReadPMutex);
 	if (size >= ret.size()) ret.expand();
@@ -160,21 +337,18 @@ std::pair <int, int> IO::BufferedFileReader::readExon(DynamicArray <char> &name,
 		pthread_mutex_unlock(&_bufferReadPMutex);
 		return std::make_pair(EOF, EOF);
 	}
-	for (; c != '\n' && c != EOF; c = nextChar_p()){
-		if (ret.first >= name.size()) name.expand();
-		name[ret.first ++] = c;
-	}
+	if (ret.first >= name.size()) name.expand();
+	name[ret.first ++] = c;
+	ret.first = appendLine_p(name, ret.first);
 	
 	for (c = '\n'; c == '\n'; c = nextChar_p());
 	if (c == EOF){
 		pthread_mutex_unlock(&_bufferReadPMutex);
 		return std::make_pair(EOF, EOF);
 	}
-	ret.second = 0;
-	for (; c != '\n' && c != EOF; c = nextChar_p()){
-		if (ret.second >= dna.size()) dna.expand();
-		dna[ret.second ++] = c;
-	}
+	if (ret.second >= dna.size()) dna.expand();
+	dna[ret.second ++] = c;
+	ret.second = appendLine_p(dna, ret.second);
 	
 	for (c = '\n'; c == '\n'; c = nextChar_p());
 	if (c == EOF){
@@ -182,10 +356,9 @@ std::pair <int, int> IO::BufferedFileReader::readExon(DynamicArray <char> &name,
 		return std::make_pair(EOF, EOF);
 	}
 	int qLen = 0;
-	for (; c != '\n' && c != EOF; c = nextChar_p()){
-		if (qLen >= quality.size()) quality.expand();
-		quality[qLen ++] = c;
-	}
+	if (qLen >= quality.size()) quality.expand();
+	quality[qLen ++] = c;
+	qLen = appendLine_p(quality, qLen);
 	pthread_mutex_unlock(&_bufferReadPMutex);
 	if (ret.first >= name.size()) name.expand();
 	name[ret.first] = 0;
@@ -198,67 +371,90 @@ std::pair <int, int> IO::BufferedFileReader::readExon(DynamicArray <char> &name,
 }
 
 IO::BufferedFileReader::BufferedFileReader(const char *fileName) : 
-	FileReader(fileName), _currentBufferLoc(0), _bufferCount(0), _isEOF(0), _isToQuit(0){
-		pthread_cond_init(&_fileReadPCondition, NULL);
-		pthread_mutex_init(&_fileReadPMutex, NULL);
+	FileReader(fileName), _isEOF(0), _isToQuit(0), _isReading(0), _head(0), _filledCount(0), _currentBufferLoc(0), _currentBuffer(0), 
+	_callerStallCount(0), _ioThreadStallCount(0){
+		pthread_cond_init(&_notEmptyCondition, NULL);
+		pthread_cond_init(&_notFullCondition, NULL);
+		pthread_mutex_init(&_ringMutex, NULL);
 		pthread_mutex_init(&_bufferReadPMutex, NULL);
 		
+		_buffers = new Buffer[READ_BUFFER_COUNT];
 		if (isOpen()){
 			setvbuf(_f , 0, _IONBF, 0);
 			
-			_currentBuffer = _lastBuffer = new Buffer(_f);
-			_bufferCount ++;
-			if (_lastBuffer -> size() < READ_BUFFER_SIZE) _isEOF = 1;
+			_buffers[0].fill(_f);
+			_currentBuffer = _buffers;
+			_filledCount = 1;
+			if (_buffers[0].size() < READ_BUFFER_SIZE) _isEOF = 1;
 		}  else {
-			this->_isEOF = true;
+			_isEOF = 1;
 		}
 }
 
+/*
+* The buffer after the filled ones is read without holding the lock, the callers do not look at it until it is counted
+*/
 void *IO::BufferedFileReader::readingProcess(void *arg){
 	BufferedFileReader *reader = (BufferedFileReader *)arg;
-	pthread_mutex_lock(&reader -> _fileReadPMutex);
-	while (1){
-		while (reader -> _bufferCount >= READ_BUFFER_COUNT){
-			pthread_cond_wait(&reader -> _fileReadPCondition, &reader -> _fileReadPMutex);
-			if (reader -> _isToQuit){
-				pthread_exit((void *)0);
-				return 0;
-			}
-		}
-		Buffer *nBuffer = new Buffer(reader -> _f);
-		reader -> _lastBuffer -> setNext(nBuffer);
-		reader -> _lastBuffer = nBuffer;
-		reader -> _bufferCount ++;
-		if (nBuffer -> size() < READ_BUFFER_SIZE){
-			reader -> _isEOF = 1;
-			break;
+	pthread_mutex_lock(&reader -> _ringMutex);
+	while (!reader -> _isToQuit && !reader -> _isEOF){
+		if (reader -> _filledCount >= READ_BUFFER_COUNT){
+			reader -> _ioThreadStallCount ++;
+			while (reader -> _filledCount >= READ_BUFFER_COUNT && !reader -> _isToQuit)
+				pthread_cond_wait(&reader -> _notFullCondition, &reader -> _ringMutex);
+			continue;
 		}
+		Buffer *buffer = reader -> _buffers + (reader -> _head + reader -> _filledCount) % READ_BUFFER_COUNT;
+		pthread_mutex_unlock(&reader -> _ringMutex);
+		buffer -> fill(reader -> _f);
+		pthread_mutex_lock(&reader -> _ringMutex);
+		reader -> _filledCount ++;
+		if (buffer -> size() < READ_BUFFER_SIZE) reader -> _isEOF = 1;
+		pthread_cond_signal(&reader -> _notEmptyCondition);
 	}
-	pthread_mutex_unlock(&reader -> _fileReadPMutex);
-	pthread_exit((void *)0);
+	pthread_mutex_unlock(&reader -> _ringMutex);
+	return 0;
 }
 
 void IO::BufferedFileReader::nextBuffer_p(){
-	pthread_mutex_lock(&_fileReadPMutex);
-	while (!_isEOF && _currentBuffer -> next() == 0){
-		pthread_mutex_unlock(&_fileReadPMutex);
-		usleep(30);
-		pthread_mutex_lock(&_fileReadPMutex);
+	pthread_mutex_lock(&_ringMutex);
+	_head = (_head + 1) % READ_BUFFER_COUNT;
+	_filledCount --;
+	pthread_cond_signal(&_notFullCondition);
+	if (_filledCount == 0 && !_isEOF){
+		_callerStallCount ++;
+		while (_filledCount == 0 && !_isEOF) pthread_cond_wait(&_notEmptyCondition, &_ringMutex);
 	}
-	Buffer *last = _currentBuffer;
+	_currentBuffer = _filledCount ? _buffers + _head : 0;
 	_currentBufferLoc = 0;
-	_currentBuffer = _currentBuffer -> next();
-	
-	delete last;
-	_bufferCount --;
-	pthread_cond_signal(&_fileReadPCondition);
-	pthread_mutex_unlock(&_fileReadPMutex);
+	pthread_mutex_unlock(&_ringMutex);
 }
 
 int IO::BufferedFileReader::nextChar_p(){
 	while (_currentBuffer && _currentBufferLoc >= _currentBuffer -> size()) nextBuffer_p();
 	if (!_currentBuffer) return EOF;
-	return (*_currentBuffer)[_currentBufferLoc ++];
+	return (unsigned char)(*_currentBuffer)[_currentBufferLoc ++];
+}
+
+int IO::BufferedFileReader::appendLine_p(DynamicArray <char> &ret, int size){
+	while (_currentBuffer){
+		if (_currentBufferLoc >= _currentBuffer -> size()){
+			nextBuffer_p();
+			continue;
+		}
+		const char *begin = _currentBuffer -> data() + _currentBufferLoc, *bufferEnd = _currentBuffer -> data() + _currentBuffer -> size();
+		const char *end = String::findChar(begin, bufferEnd, '\n');
+		int count = end - begin;
+		if (size + count >= (int)ret.size()) ret.resize(size + count >= (int)ret.size() << 1 ? size + count + 1 : ret.size() << 1);
+		memcpy(ret.data() + size, begin, count);
+		size += count;
+		_currentBufferLoc += count;
+		if (end < bufferEnd){
+			_currentBufferLoc ++;
+			break;
+		}
+	}
+	return size;
 }
 
 
@@ -284,43 +480,56 @@ void IO::FileWriter::putString(const DynamicArray <char> &s, unsigned size){
 /*
  * Class BufferedFileWriter
  */
-IO::BufferedFileWriter::Buffer::Buffer(const char *s, unsigned int size) : size(size), next(0){
-	this -> s = new char[size];
-	memcpy(this -> s, s, size);
-}
-
-IO::BufferedFileWriter::Buffer::~Buffer(){
-	delete[] s;
-}
-
-IO::BufferedFileWriter *IO::BufferedFileWriter::newBufferedFileWriter(const char *fileName){
-	BufferedFileWriter *ret = new BufferedFileWriter(fileName);
+IO::BufferedFileWriter *IO::BufferedFileWriter::newBufferedFileWriter(const char *fileName, int bufferCount, unsigned bufferSize){
+	BufferedFileWriter *ret = new BufferedFileWriter(fileName, bufferCount, bufferSize);
 	
 	if (ret){
 		pthread_attr_t attr;
 		pthread_attr_init(&attr);
 		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
 		pthread_create(&ret -> _writingThread, &attr, writingProcess, (void *)ret);
+		pthread_attr_destroy(&attr);
 	}
 	return ret;
 }
 
-
+/*
+* The writing thread writes out everything committed before it quits
+*/
 IO::BufferedFileWriter::~BufferedFileWriter(){
+	pthread_mutex_lock(&_poolMutex);
 	_isToQuit = 1;
-	while (_currentBuffer){
-		pthread_cond_signal(&_fileWriteCondition);
-		usleep(30);
-	}
-	Buffer *next;
-	for (Buffer *p = _currentBuffer; p; p = next){
-		next = p -> next;
-		delete p;
-	}
+	pthread_cond_signal(&_committedCondition);
+	pthread_mutex_unlock(&_poolMutex);
+	pthread_join(_writingThread, NULL);
+	delete[] _buffers;
 	
-	
-	pthread_cond_destroy(&_fileWriteCondition);
-	pthread_mutex_destroy(&_bufferWriteMutex);
+	pthread_cond_destroy(&_committedCondition);
+	pthread_cond_destroy(&_freeCondition);
+	pthread_mutex_destroy(&_poolMutex);
+}
+
+IO::BufferedFileWriter::Buffer *IO::BufferedFileWriter::acquire(){
+	pthread_mutex_lock(&_poolMutex);
+	if (!_freeBuffers){
+		_callerStallCount ++;
+		while (!_freeBuffers) pthread_cond_wait(&_freeCondition, &_poolMutex);
+	}
+	Buffer *ret = _freeBuffers;
+	_freeBuffers = ret -> next;
+	pthread_mutex_unlock(&_poolMutex);
+	return ret;
+}
+
+void IO::BufferedFileWriter::commit(Buffer *buffer, unsigned size){
+	buffer -> size = size;
+	buffer -> next = 0;
+	pthread_mutex_lock(&_poolMutex);
+	if (_lastCommitted) _lastCommitted -> next = buffer;
+	else _firstCommitted = buffer;
+	_lastCommitted = buffer;
+	pthread_cond_signal(&_committedCondition);
+	pthread_mutex_unlock(&_poolMutex);
 }
 
 void IO::BufferedFileWriter::putString(const DynamicArray <char> &s, unsigned int size){
@@ -328,61 +537,290 @@ void IO::BufferedFileWriter::putString(const DynamicArray <char> &s, unsigned in
 }
 
 void IO::BufferedFileWriter::putString(const char *s, unsigned int size){
-    Buffer *buf = new Buffer(s, size);
-	while (_bufferCount >= WRITE_BUFFER_COUNT) usleep(30);
-	pthread_mutex_lock(&_bufferWriteMutex);
-	if (_lastBuffer) _lastBuffer -> next = buf;
-	else _currentBuffer = buf;
-	_lastBuffer = buf;
-	
-	_bufferCount ++;
-	pthread_mutex_unlock(&_bufferWriteMutex);
-	pthread_cond_signal(&_fileWriteCondition);
+	Buffer *buffer = acquire();
+	if (size > buffer -> data.size()) buffer -> data.resize(size);
+	memcpy(buffer -> data.data(), s, size);
+	commit(buffer, size);
+}
+
+unsigned long IO::BufferedFileWriter::callerStallCount() const{
+	return _callerStallCount;
+}
+
+unsigned long IO::BufferedFileWriter::ioThreadStallCount() const{
+	return _ioThreadStallCount;
 }
 
-IO::BufferedFileWriter::BufferedFileWriter(const char *fileName) : 
-	FileWriter(fileName), _isToQuit(0), _bufferCount(0), _currentBuffer(0), _lastBuffer(0){
+/*
+* Sizing every buffer up front also faults its pages in, before the callers start to fill them
+*/
+IO::BufferedFileWriter::BufferedFileWriter(const char *fileName, int bufferCount, unsigned bufferSize) : 
+	FileWriter(fileName), _isToQuit(0), _freeBuffers(0), _firstCommitted(0), _lastCommitted(0), _callerStallCount(0), _ioThreadStallCount(0){
 		setvbuf(_f , 0, _IONBF, 0);
 		
-		pthread_cond_init(&_fileWriteCondition, NULL);
-		pthread_mutex_init(&_bufferWriteMutex, NULL);
+		pthread_cond_init(&_committedCondition, NULL);
+		pthread_cond_init(&_freeCondition, NULL);
+		pthread_mutex_init(&_poolMutex, NULL);
+		_buffers = new Buffer[bufferCount];
+		for (int i = 0; i < bufferCount; i ++){
+			_buffers[i].data.resize(bufferSize);
+			_buffers[i].next = _freeBuffers;
+			_freeBuffers = _buffers + i;
+		}
 }
 
+/*
+* Takes every committed buffer at once, writes them out without holding the lock and gives them back to the pool
+*/
 void *IO::BufferedFileWriter::writingProcess(void *arg){
 	BufferedFileWriter *writer = (BufferedFileWriter *)arg;
-	pthread_mutex_lock(&writer -> _bufferWriteMutex);
+	pthread_mutex_lock(&writer -> _poolMutex);
 	while (1){
-		while (writer -> _bufferCount == 0 && !writer -> _isToQuit)
-			pthread_cond_wait(&writer -> _fileWriteCondition, &writer -> _bufferWriteMutex);
-		if (writer -> _bufferCount == 0 && writer -> _isToQuit){
-			pthread_exit((void *)0);
-			return 0;
+		if (!writer -> _firstCommitted){
+			if (writer -> _isToQuit) break;
+			writer -> _ioThreadStallCount ++;
+			pthread_cond_wait(&writer -> _committedCondition, &writer -> _poolMutex);
+			continue;
+		}
+		Buffer *first = writer -> _firstCommitted;
+		writer -> _firstCommitted = writer -> _lastCommitted = 0;
+		pthread_mutex_unlock(&writer -> _poolMutex);
+		writer -> writeBuffers_p(first);
+		pthread_mutex_lock(&writer -> _poolMutex);
+		Buffer *next;
+		for (Buffer *p = first; p; p = next){
+			next = p -> next;
+			p -> next = writer -> _freeBuffers;
+			writer -> _freeBuffers = p;
 		}
-		bool unlock = 0;
-		if (writer -> _currentBuffer != writer -> _lastBuffer) unlock = 1;
-		if (unlock) pthread_mutex_unlock(&writer -> _bufferWriteMutex);
-		fwrite(writer -> _currentBuffer -> s, 1, writer -> _currentBuffer -> size, writer -> _f);
-		if (unlock) pthread_mutex_lock(&writer -> _bufferWriteMutex);
-		writer -> nextBuffer_p();
+		pthread_cond_broadcast(&writer -> _freeCondition);
 	}
-	pthread_mutex_unlock(&writer -> _bufferWriteMutex);
-	pthread_exit((void *)0);
+	pthread_mutex_unlock(&writer -> _poolMutex);
+	return 0;
 }
 
-void IO::BufferedFileWriter::nextBuffer_p(){
-	Buffer *last = _currentBuffer;
-	_currentBuffer = last -> next;
-	delete last;
-	if (!_currentBuffer) _lastBuffer = 0;
-	
-	_bufferCount --;
+/*
+* Up to WRITE_VECTOR_SIZE buffers go into one writev(), a short write continues from where it stopped
+*/
+void IO::BufferedFileWriter::writeBuffers_p(Buffer *first){
+	struct iovec vector[WRITE_VECTOR_SIZE];
+	int fd = fileno(_f);
+	while (first){
+		int count = 0;
+		for (; first && count < WRITE_VECTOR_SIZE; first = first -> next){
+			if (!first -> size) continue;
+			vector[count].iov_base = first -> data.data();
+			vector[count].iov_len = first -> size;
+			count ++;
+		}
+		struct iovec *v = vector;
+		while (count){
+			ssize_t written = writev(fd, v, count);
+			if (written < 0){
+				if (errno == EINTR) continue;
+				return;
+			}
+			for (; count && (size_t)written >= v -> iov_len; v ++, count --) written -= v -> iov_len;
+			if (count){
+				v -> iov_base = (char *)v -> iov_base + written;
+				v -> iov_len -= written;
+			}
+		}
+	}
 }
 
 
+/*
+ * Class ReadBatch
+ */
+IO::ReadBatch::ReadBatch() : _arena(READ_BATCH_SIZE * 256), _output(1), _arenaSize(0), _outputSize(0), _sequence(0), _isFree(1), _isDone(0){
+	_reads.reserve(READ_BATCH_SIZE);
+}
+
+/*
+* The DNA is lower-cased in the arena, the reader may hand out read-only records
+*/
+void IO::ReadBatch::add(const char *name, int nameSize, const char *dna, int dnaSize, const char *quality, int qualitySize){
+	unsigned size = nameSize + dnaSize + qualitySize + 3;
+	if (_arenaSize + size > _arena.size()) _arena.resize(std::max(_arena.size() << 1, _arenaSize + size));
+	Read read;
+	read.name = _arenaSize;
+	read.dna = read.name + nameSize + 1;
+	read.quality = read.dna + dnaSize + 1;
+	read.dnaSize = dnaSize;
+	memcpy(_arena.data() + read.name, name, nameSize); _arena[read.name + nameSize] = 0;
+	memcpy(_arena.data() + read.dna, dna, dnaSize); _arena[read.dna + dnaSize] = 0;
+	String::toLower(_arena.data() + read.dna);
+	memcpy(_arena.data() + read.quality, quality, qualitySize); _arena[read.quality + qualitySize] = 0;
+	_arenaSize += size;
+	_reads.push_back(read);
+}
+
+void IO::ReadBatch::clear(){
+	_arenaSize = _outputSize = 0;
+	_reads.clear();
+}
+
+char *IO::ReadBatch::dna(int x){
+	return _arena.data() + _reads[x].dna;
+}
+
+int IO::ReadBatch::dnaSize(int x) const{
+	return _reads[x].dnaSize;
+}
+
+bool IO::ReadBatch::isFull() const{
+	return _reads.size() >= READ_BATCH_SIZE;
+}
+
+char *IO::ReadBatch::name(int x){
+	return _arena.data() + _reads[x].name;
+}
+
+DynamicArray <char> &IO::ReadBatch::output(){
+	return _output;
+}
+
+char *IO::ReadBatch::quality(int x){
+	return _arena.data() + _reads[x].quality;
+}
+
+unsigned long IO::ReadBatch::sequence() const{
+	return _sequence;
+}
+
+int IO::ReadBatch::size() const{
+	return _reads.size();
+}
+
+/*
+ * Class ReadBatchQueue
+ */
+IO::ReadBatchQueue::ReadBatchQueue(FileReader *reader, int batchCount) : 
+	_reader(reader), _batchCount(batchCount), _produced(0), _consumed(0), _emitted(0), _isEOF(0), _isEmitting(0), _isProducerWaiting(0), 
+	_waitingCount(0){
+		pthread_cond_init(&_producedCondition, NULL);
+		pthread_cond_init(&_freedCondition, NULL);
+		pthread_mutex_init(&_waitMutex, NULL);
+		_batches = new ReadBatch[_batchCount];
+}
+
+IO::ReadBatchQueue::~ReadBatchQueue(){
+	pthread_join(_producingThread, NULL);
+	pthread_cond_destroy(&_producedCondition);
+	pthread_cond_destroy(&_freedCondition);
+	pthread_mutex_destroy(&_waitMutex);
+	delete[] _batches;
+}
+
+IO::ReadBatchQueue *IO::ReadBatchQueue::newReadBatchQueue(FileReader *reader, int batchCount){
+	ReadBatchQueue *ret = new ReadBatchQueue(reader, batchCount);
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+	pthread_create(&ret -> _producingThread, &attr, producingProcess, (void *)ret);
+	pthread_attr_destroy(&attr);
+	return ret;
+}
+
+/*
+* The batch of ticket t lives in slot t % _batchCount, and is published once _produced > t.
+* A consumer counts itself in _waitingCount before it checks again under the lock, and the producer reads
+* _waitingCount after storing _produced, both in sequentially consistent order, so one of them sees the other
+*/
+IO::ReadBatch *IO::ReadBatchQueue::acquire(){
+	unsigned long ticket = __atomic_fetch_add(&_consumed, 1, __ATOMIC_RELAXED);
+	if (ticket >= __atomic_load_n(&_produced, __ATOMIC_ACQUIRE)){
+		pthread_mutex_lock(&_waitMutex);
+		__atomic_add_fetch(&_waitingCount, 1, __ATOMIC_SEQ_CST);
+		while (ticket >= __atomic_load_n(&_produced, __ATOMIC_SEQ_CST) && !__atomic_load_n(&_isEOF, __ATOMIC_SEQ_CST))
+			pthread_cond_wait(&_producedCondition, &_waitMutex);
+		__atomic_sub_fetch(&_waitingCount, 1, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&_waitMutex);
+		if (ticket >= __atomic_load_n(&_produced, __ATOMIC_ACQUIRE)) return 0;
+	}
+	return _batches + ticket % _batchCount;
+}
+
+/*
+* Whoever wins _isEmitting writes out every finished batch that is next in order, the others just leave
+* theirs behind. Slots are only released after being written, so at most _batchCount batches are pending.
+* The emitter looks at the next batch again after giving _isEmitting up, so a batch finished meanwhile is not stranded
+*/
+void IO::ReadBatchQueue::emit(ReadBatch *batch, unsigned outputSize, FileWriter *writer){
+	batch -> _outputSize = outputSize;
+	__atomic_store_n(&batch -> _isDone, 1, __ATOMIC_SEQ_CST);
+	while (!__atomic_exchange_n(&_isEmitting, 1, __ATOMIC_SEQ_CST)){
+		ReadBatch *next;
+		while (__atomic_load_n(&(next = _batches + _emitted % _batchCount) -> _isDone, __ATOMIC_ACQUIRE) && next -> _sequence == _emitted){
+			if (next -> _outputSize) writer -> putString(next -> _output.data(), next -> _outputSize);
+			__atomic_store_n(&next -> _isDone, 0, __ATOMIC_RELAXED);
+			__atomic_store_n(&_emitted, _emitted + 1, __ATOMIC_RELAXED);
+			release(next);
+		}
+		__atomic_store_n(&_isEmitting, 0, __ATOMIC_SEQ_CST);
+		unsigned long emitted = __atomic_load_n(&_emitted, __ATOMIC_RELAXED);
+		next = _batches + emitted % _batchCount;
+		if (!__atomic_load_n(&next -> _isDone, __ATOMIC_SEQ_CST) || next -> _sequence != emitted) break;
+	}
+}
+
+void IO::ReadBatchQueue::release(ReadBatch *batch){
+	__atomic_store_n(&batch -> _isFree, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&_isProducerWaiting, __ATOMIC_SEQ_CST)){
+		pthread_mutex_lock(&_waitMutex);
+		pthread_cond_signal(&_freedCondition);
+		pthread_mutex_unlock(&_waitMutex);
+	}
+}
+
+void IO::ReadBatchQueue::wakeConsumers_p(){
+	if (__atomic_load_n(&_waitingCount, __ATOMIC_SEQ_CST)){
+		pthread_mutex_lock(&_waitMutex);
+		pthread_cond_broadcast(&_producedCondition);
+		pthread_mutex_unlock(&_waitMutex);
+	}
+}
+
+void *IO::ReadBatchQueue::producingProcess(void *arg){
+	ReadBatchQueue *queue = (ReadBatchQueue *)arg;
+	FileReader::Record record;
+	for (unsigned long sequence = 0;; sequence ++){
+		ReadBatch *batch = queue -> _batches + sequence % queue -> _batchCount;
+		if (!__atomic_load_n(&batch -> _isFree, __ATOMIC_ACQUIRE)){
+			pthread_mutex_lock(&queue -> _waitMutex);
+			__atomic_store_n(&queue -> _isProducerWaiting, 1, __ATOMIC_SEQ_CST);
+			while (!__atomic_load_n(&batch -> _isFree, __ATOMIC_SEQ_CST)) pthread_cond_wait(&queue -> _freedCondition, &queue -> _waitMutex);
+			__atomic_store_n(&queue -> _isProducerWaiting, 0, __ATOMIC_RELAXED);
+			pthread_mutex_unlock(&queue -> _waitMutex);
+		}
+		batch -> clear();
+		batch -> _sequence = sequence;
+		
+		while (!batch -> isFull() && queue -> _reader -> readRecord(record))
+			batch -> add(record.name, record.nameSize, record.dna, record.dnaSize, record.quality, record.qualitySize);
+		if (batch -> size()){
+			__atomic_store_n(&batch -> _isFree, 0, __ATOMIC_RELAXED);
+			__atomic_store_n(&queue -> _produced, sequence + 1, __ATOMIC_SEQ_CST);
+			queue -> wakeConsumers_p();
+		}
+		if (!batch -> isFull()) break;
+	}
+	__atomic_store_n(&queue -> _isEOF, 1, __ATOMIC_SEQ_CST);
+	queue -> wakeConsumers_p();
+	return 0;
+}
+
 /*
 * Namespace IO
 */
 namespace IO{
+	FileReader *newFileReader(const char *fileName){
+		FileReader *ret = MappedFileReader::newMappedFileReader(fileName);
+		if (!ret) ret = BufferedFileReader::newBufferedFileReader(fileName);
+		return ret;
+	}
+	
 	unsigned long readUnsignedHex(FileReader &f){
 		unsigned long ret = 0;
 		int c = 0;
@@ -407,39 +845,39 @@ namespace IO{
 	}
 	
 	int readLine(FileReader &f, DynamicArray <char> &ret){
-		int size = 0, c = '\n';
-		for (; c == '\n'; c = f.nextChar());
-		if (c == EOF) return -1;
-		for (; c != '\n' && c != EOF; c = f.nextChar()){
-			if (size >= ret.size()) ret.expand();
-			ret[size ++] = c;
-		}
-		if (size >= ret.size()) ret.expand();
-		ret[size] = 0;
+		int size;
+		while ((size = f.readLine(ret)) == 0);
 		return size;
 	}
 	
 	std::list <Dna *> readDna(const char *fileName){
 		std::list <Dna *> ret;
 		
-		FileReader reader(fileName);
-		if (!reader.isOpen()) return ret;
+		FileReader *reader = newFileReader(fileName);
+		if (!reader -> isOpen()){
+			delete reader;
+			return ret;
+		}
 		DynamicArray <char> buffer(1000);
 		int size;
-		while (size = readLine(reader, buffer)){
+		while ((size = readLine(*reader, buffer)) > 0){
 			if (buffer[0] != '>'){
 				int validLen = String::dnaFormat(buffer);
 				if (validLen >= MIN_VALID_LEN) ret.push_back(new Dna(buffer.data(), size));
 			}
 		}
+		delete reader;
 		return ret;
 	}
 
 	std::list <Exon *> readExon(const char *fileName){
 		std::list <Exon *> ret;
 		
-		BufferedFileReader *reader = BufferedFileReader::newBufferedFileReader(fileName);
-		if (!reader -> isOpen()) return ret;
+		FileReader *reader = newFileReader(fileName);
+		if (!reader -> isOpen()){
+			delete reader;
+			return ret;
+		}
 		DynamicArray <char> bufferName(100), bufferDna(1000);
 		int sizeName, sizeDna;
 		while ((sizeName = reader -> readLine(bufferName) >= 0) && (sizeDna = reader -> readLine(bufferDna)) >= 0){
@@ -23,11 +23,14 @@
 
 #include <list>
 #include <string>
+#include <vector>
 #include <cstdio>
 
 #define READ_BUFFER_SIZE 131072
 #define READ_BUFFER_COUNT 64
 #define WRITE_BUFFER_COUNT 16
+#define WRITE_BUFFER_SIZE 1048576
+#define READ_BATCH_SIZE 4096
 
 #include "DynamicArray.h"
 #include "MatchStructures.h"
@@ -35,21 +38,83 @@
 namespace IO{
 	class FileReader{
 		public:
+			/*
+			* A read of a FDQ file: its name, DNA and quality lines, none of them is terminated by 0
+			*/
+			struct Record{
+				const char *name, *dna, *quality;
+				int nameSize, dnaSize, qualitySize;
+			};
+			
 			FileReader(const char *fileName);
-			~FileReader();
+			virtual ~FileReader();
 			
 			bool isOpen() const;
 			virtual inline int nextChar();
 			virtual inline int readLine(DynamicArray <char> &ret);
 			virtual inline std::pair <int, int> readExon(DynamicArray <char> &name, DynamicArray <char> &dna, DynamicArray <char> &quality);
+			virtual bool readRecord(Record &record);
+			/*
+			* Returns 0 at the end of the file. The record stays valid until the next call, the DNA is not formatted
+			*/
+			virtual int peekChar();
+			/*
+			* Returns the next char (or EOF) without taking it
+			*/
+			virtual const char *nextBlock(unsigned size);
+			/*
+			* Takes the next size chars, returns 0 when fewer are left. The block stays valid until the next call
+			*/
 			
 		protected:
 			FILE *_f;
 			
 		private:
 			std::string _fileName;
+			DynamicArray <char> _recordName, _recordDna, _recordQuality, _block;
+	};
+	
+	/*
+	* Reads a regular file through a read-only mapping: lines are found with memchr(), and readRecord() and nextLine()
+	* hand out pointers into the mapping instead of copying every character
+	*/
+	class MappedFileReader : public FileReader{
+		public:
+			~MappedFileReader();
+			
+			static MappedFileReader *newMappedFileReader(const char *fileName);
+			/*
+			* Returns 0 when the file cannot be mapped (for example a pipe)
+			*/
+			int nextChar();
+			int nextLine(const char *&line);
+			/*
+			* Points line at the next line and returns its length without '\n', or EOF. The line stays valid during
+			* the lifetime of the reader, but is not terminated by 0
+			*/
+			int readLine(DynamicArray <char> &ret);
+			std::pair <int, int> readExon(DynamicArray <char> &name, DynamicArray <char> &dna, DynamicArray <char> &quality);
+			bool readRecord(Record &record);
+			int peekChar();
+			const char *nextBlock(unsigned size);
+			/*
+			* The block points into the mapping and stays valid during the lifetime of the reader
+			*/
+			
+		private:
+			const char *_data;
+			unsigned long _size, _loc;
+			bool _isMapped;
+			
+			MappedFileReader(const char *fileName);
+			
+			int nextNonEmptyLine_p(const char *&line);
 	};
 	
+	/*
+	* A reading thread fills a ring of READ_BUFFER_COUNT buffers which are allocated once and reused,
+	* either side blocks on a condition when the ring is empty or full
+	*/
 	class BufferedFileReader : public FileReader{
 		public:
 			~BufferedFileReader();
@@ -57,45 +122,62 @@ namespace IO{
 			static BufferedFileReader *newBufferedFileReader(const char *fileName);
 			virtual inline int readLine(DynamicArray <char> &ret);
 			virtual inline std::pair <int, int> readExon(DynamicArray <char> &name, DynamicArray <char> &dna, DynamicArray <char> &quality);
+			int nextChar();
+			int peekChar();
+			const char *nextBlock(unsigned size);
+			unsigned long callerStallCount() const;
+			/*
+			* How many times the callers waited for the reading thread (input bound)
+			*/
+			unsigned long ioThreadStallCount() const;
+			/*
+			* How many times the reading thread waited for a free buffer (compute bound)
+			*/
 			
 		private:
 			class Buffer{
 				public:
-					Buffer(FILE *f);
+					Buffer();
+					
+					void fill(FILE *f);
 					/*
-					Buffer reads data immediately when the object is constructed
+					* Reads up to READ_BUFFER_SIZE chars, fewer only at the end of the file
 					*/
-					~Buffer();
-					
 					inline int size() const;
-					inline Buffer *next() const;
-					void setNext(Buffer *next);
 					inline char operator [](int x) const;
+					inline const char *data() const;
 				
 				private:
 					unsigned _size;
 					char _data[READ_BUFFER_SIZE];
-					Buffer *_next;
 			};
 			
 			BufferedFileReader(const char* fileName);
 			
-			bool _isEOF, _isToQuit;
-			unsigned _bufferCount;
+			bool _isEOF, _isToQuit, _isReading;
+			Buffer *_buffers;
+			unsigned _head, _filledCount;
+			/*
+			* The filled buffers are _buffers[_head] and the _filledCount - 1 after it, the reading thread only touches the others
+			*/
 			unsigned _currentBufferLoc;
-			Buffer *_currentBuffer, *_lastBuffer;
+			Buffer *_currentBuffer;
+			unsigned long _callerStallCount, _ioThreadStallCount;
 			
 			pthread_t _readThread;
-			pthread_mutex_t _fileReadPMutex;
-			pthread_cond_t _fileReadPCondition;
-			/*
-				when a buffer is erased, a signal is send, to tell the reading thread to read in the new buffer
-			*/
+			pthread_mutex_t _ringMutex;
+			pthread_cond_t _notEmptyCondition, _notFullCondition;
 			pthread_mutex_t _bufferReadPMutex;
 			
 			static void *readingProcess(void *arg);
 			void nextBuffer_p();
 			int nextChar_p();
+			/*
+			* Appends the rest of the current line to ret from size on, consumes the newline and returns the new size
+			*/
+			int appendLine_p(DynamicArray <char> &ret, int size);
+			
+			DynamicArray <char> _block;
 	};
 	
 	class FileWriter{
@@ -113,40 +195,136 @@ namespace IO{
 			std::string _fileName;
 	};
 	
+	/*
+	* Callers take buffers from a pool of reusable, pre-faulted buffers, fill them in place and commit them,
+	* a writing thread writes the committed buffers out with writev() and returns them to the pool.
+	* Either side blocks on a condition when the pool is empty or nothing is committed
+	*/
 	class BufferedFileWriter : public FileWriter{
 		public:
 			struct Buffer{
+				DynamicArray <char> data;
 				unsigned size;
-				char *s;
 				Buffer *next;
-				
-				Buffer(const char *s, unsigned size);
-				~Buffer();
 			};
 			
 			~BufferedFileWriter();
 			
-			static BufferedFileWriter *newBufferedFileWriter(const char *fileName);
+			static BufferedFileWriter *newBufferedFileWriter(const char *fileName, int bufferCount = WRITE_BUFFER_COUNT, unsigned bufferSize = WRITE_BUFFER_SIZE);
 			
-			virtual inline void putString(const DynamicArray <char> &s, unsigned size);
-			virtual inline void putString(const char *s, unsigned size);
+			Buffer *acquire();
+			/*
+			* Takes a free buffer of at least the pool's buffer size, the caller may grow buffer -> data
+			*/
+			void commit(Buffer *buffer, unsigned size);
+			/*
+			* Queues the first size chars of buffer -> data, buffers are written out in the order they are committed
+			*/
+			virtual void putString(const DynamicArray <char> &s, unsigned size);
+			virtual void putString(const char *s, unsigned size);
+			unsigned long callerStallCount() const;
+			/*
+			* How many times the callers waited for a free buffer (output bound)
+			*/
+			unsigned long ioThreadStallCount() const;
+			/*
+			* How many times the writing thread waited for a committed buffer (compute bound)
+			*/
 			
 		private:
 			pthread_t _writingThread;
-			pthread_cond_t _fileWriteCondition;
-			pthread_mutex_t _fileWriteMutex;
-			pthread_mutex_t _bufferWriteMutex;
+			pthread_mutex_t _poolMutex;
+			pthread_cond_t _committedCondition, _freeCondition;
 			
 			bool _isToQuit;
-			int _bufferCount;
-			Buffer *_currentBuffer, *_lastBuffer;
+			Buffer *_buffers;
+			Buffer *_freeBuffers, *_firstCommitted, *_lastCommitted;
+			unsigned long _callerStallCount, _ioThreadStallCount;
 			
-			BufferedFileWriter(const char *fileName);
+			BufferedFileWriter(const char *fileName, int bufferCount, unsigned bufferSize);
 			
 			static void *writingProcess(void *arg);
-			void nextBuffer_p();
+			void writeBuffers_p(Buffer *first);
+	};
+	
+	/*
+	* Up to READ_BATCH_SIZE reads stored in one contiguous arena
+	*/
+	class ReadBatch{
+		friend class ReadBatchQueue;
+		
+		public:
+			ReadBatch();
+			
+			void add(const char *name, int nameSize, const char *dna, int dnaSize, const char *quality, int qualitySize);
+			void clear();
+			char *dna(int x);
+			int dnaSize(int x) const;
+			bool isFull() const;
+			char *name(int x);
+			DynamicArray <char> &output();
+			char *quality(int x);
+			unsigned long sequence() const;
+			int size() const;
+			
+		private:
+			struct Read{
+				unsigned name, dna, quality;
+				int dnaSize;
+			};
+			
+			DynamicArray <char> _arena, _output;
+			unsigned _arenaSize, _outputSize;
+			std::vector <Read> _reads;
+			unsigned long _sequence;
+			bool _isFree, _isDone;
+	};
+	
+	/*
+	* A producer thread parses reads into a ring of batches, consumers claim the batches in input order
+	* with an atomic ticket and give them back with release(). Neither side takes a lock while there is work,
+	* a consumer ahead of the producer, or the producer on a full ring, sleeps on a condition until woken
+	*/
+	class ReadBatchQueue{
+		public:
+			~ReadBatchQueue();
+			
+			static ReadBatchQueue *newReadBatchQueue(FileReader *reader, int batchCount);
+			/*
+			* Returns 0 when all reads are consumed
+			*/
+			ReadBatch *acquire();
+			/*
+			* Hands the first outputSize bytes of batch -> output() back, they are written out in input order
+			*/
+			void emit(ReadBatch *batch, unsigned outputSize, FileWriter *writer);
+			void release(ReadBatch *batch);
+			
+		private:
+			ReadBatchQueue(FileReader *reader, int batchCount);
+			
+			FileReader *_reader;
+			ReadBatch *_batches;
+			int _batchCount;
+			unsigned long _produced, _consumed, _emitted;
+			bool _isEOF, _isEmitting, _isProducerWaiting;
+			int _waitingCount;
+			pthread_mutex_t _waitMutex;
+			pthread_cond_t _producedCondition, _freedCondition;
+			pthread_t _producingThread;
+			
+			static void *producingProcess(void *arg);
+			void wakeConsumers_p();
+			/*
+			* Wakes the consumers that sleep in acquire(), called after storing _produced or _isEOF
+			*/
 	};
 	
+	FileReader *newFileReader(const char *fileName);
+	/*
+	* A MappedFileReader, or a BufferedFileReader when the file cannot be mapped
+	*/
+	
 	int readLine(FileReader &f, DynamicArray <char> &ret);
 	
 	std::list <Dna *> readDna(const char *fileName);
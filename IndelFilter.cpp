@@ -16,6 +16,11 @@
  ******************************************************************************/
 
 
+#include "IO.h"
+#include "String.h"
+#include "DynamicArray.h"
+
+#include <getopt.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -24,6 +29,10 @@
 #define MIN_READ_DEPTH 1
 #define MAX_READ_DEPTH 10000
 #define MIN_SCORE_DELTA 100.0
+/*
+* Name, type, location, depth and the two scores are the first 6 tab separated fields of an insertion/deletion line
+*/
+#define INDEL_TAB_COUNT 5
 
 using namespace std;
 
@@ -94,23 +103,26 @@ int main(int argc, char **argv){
 		showUsage();
 		return 0;
 	}
-	FILE *f = fopen(inputFileName.c_str(), "r");
-	if (!f){
+	IO::FileReader *reader = IO::newFileReader(inputFileName.c_str());
+	if (!reader -> isOpen()){
 		printf("ERROR: cannot open input file.\n");
+		delete reader;
 		return 0;
 	}
 	FILE *fout = fopen(outputFileName.c_str(), "w");
-	char s[1000], name[1000], type[1000];
-	while (fgets(s, 1000, f)){
-		s[strlen(s) - 1] = 0;
-		int depth;
-		double s1, s2;
-		sscanf(s, "%s%s%*d%d%lf%lf", name, type, &depth, &s1, &s2);
+	DynamicArray <char> line(1000);
+	int size, tabs[INDEL_TAB_COUNT];
+	while ((size = reader -> readLine(line)) != EOF){
+		if (String::findChars(line.data(), size, '\t', tabs, INDEL_TAB_COUNT) < INDEL_TAB_COUNT) continue;
+		char type = line[tabs[0] + 1];
+		int depth = atoi(line.data() + tabs[2] + 1);
+		double s1 = atof(line.data() + tabs[3] + 1), s2 = atof(line.data() + tabs[4] + 1);
 		double ds = s1 - s2;
-		if ((type[0] == 'I' || type[0] == 'D') && ds >= minScoreDelta && depth >= minReadDepth && depth <= maxReadDepth){
-			fprintf(fout, "%s\n", s);
+		if ((type == 'I' || type == 'D') && ds >= minScoreDelta && depth >= minReadDepth && depth <= maxReadDepth){
+			fprintf(fout, "%s\n", line.data());
 		}
 	}
-	fclose(f);
+	fclose(fout);
+	delete reader;
 	return 0;
 }
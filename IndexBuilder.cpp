@@ -0,0 +1,154 @@
+/*******************************************************************************
+ * This file is part of SAP.
+ * 
+ * SAP is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * SAP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with SAP.  If not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************/
+
+
+
+#include <string>
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "MatchStructures.h"
+#include "MatchHash.h"
+#include "MatchIndex.h"
+
+#define DEFAULT_PIECE_SIZE 15
+#define DEFAULT_HASH_BINARY_SIZE 27
+#define DEFAULT_THREAD_COUNT 1
+#define DEFAULT_WINDOW_SIZE 0
+#define DEFAULT_IS_SPLIT_KEY 0
+
+std::string referenceFileName;
+std::string outputFileName;
+int pieceSize = DEFAULT_PIECE_SIZE;
+int hashBinarySize = DEFAULT_HASH_BINARY_SIZE;
+int threadCount = DEFAULT_THREAD_COUNT;
+int windowSize = DEFAULT_WINDOW_SIZE;
+bool isSplitKey = DEFAULT_IS_SPLIT_KEY;
+
+void showWelcome(){
+	fprintf(stderr, "DNA Index Builder - 0.99.85\n");
+}
+
+void showUsage(){
+	fprintf(stderr, "	-r	Set reference file name.\n");
+	fprintf(stderr, "	-o	Set output (index) file name.\n");
+	fprintf(stderr, "	-H	Set the binary size of hash, usually between 20 and 30 (Default: 27)\n");
+	fprintf(stderr, "	-p	Set the size of small pieces when mapping, usually between 10 and 16, at most 31. (Default: 15)\n");
+	fprintf(stderr, "	-w	Only index the minimizers of every w consecutive pieces, 0 indexes every piece. (Default: 0)\n");
+	fprintf(stderr, "		About 2 / (w + 1) of the pieces are stored, and fewer reads are mapped (see Mapper -w).\n");
+	fprintf(stderr, "	-P	Also store the hash of half pieces, used by the split-key search of Mapper (-P).\n");
+	fprintf(stderr, "	-t	Set thread count. (Default: 1)\n");
+	fprintf(stderr, "	-h	Show this help.\n");
+}
+
+bool processArguments(int argc, char **argv){
+	char c;
+	while ((c = getopt(argc, argv, "r:o:H:p:w:Pt:h")) != EOF){
+		switch (c){
+			case 'r':
+				referenceFileName = optarg;
+				break;
+			case 'o':
+				outputFileName = optarg;
+				break;
+			case 'H':
+				hashBinarySize = atoi(optarg);
+				break;
+			case 'p':
+				pieceSize = atoi(optarg);
+				break;
+			case 'w':
+				windowSize = atoi(optarg);
+				break;
+			case 'P':
+				isSplitKey = 1;
+				break;
+			case 't':
+				threadCount = atoi(optarg);
+				break;
+			case 'h':
+				return 1;
+		}
+	}
+	
+	if (referenceFileName.empty()){
+		fprintf(stderr, "ERROR: reference file (-r) missing.\n");
+		return 1;
+	}
+	
+	if (outputFileName.empty()){
+		fprintf(stderr, "ERROR: output file (-o) missing.\n");
+		return 1;
+	}
+	
+	if (hashBinarySize < 20 || hashBinarySize > 32){
+		fprintf(stderr, "ERROR: Hash binary size should between 20 and 32.\n");
+		return 1;
+	}
+	
+	if (pieceSize > MAX_PIECE_SIZE || pieceSize < 10){
+		fprintf(stderr, "ERROR: Piece size should between 10 and %d.\n", MAX_PIECE_SIZE);
+		return 1;
+	}
+	
+	if (windowSize < 0 || windowSize > 64){
+		fprintf(stderr, "ERROR: Window size should between 0 and 64.\n");
+		return 1;
+	}
+	
+	if (isSplitKey && windowSize){
+		fprintf(stderr, "ERROR: The hash of half pieces needs every piece in the hash (-w 0).\n");
+		return 1;
+	}
+	
+	fprintf(stderr, "	Reference file name: %s\n", referenceFileName.c_str());
+	fprintf(stderr, "	Output file name: %s\n", outputFileName.c_str());
+	fprintf(stderr, "	Hash size: %llu\n", 1ULL << hashBinarySize);
+	fprintf(stderr, "	Piece size: %d\n", pieceSize);
+	if (windowSize) fprintf(stderr, "	Minimizer window size: %d\n", windowSize);
+	if (isSplitKey) fprintf(stderr, "	Hash of half pieces enabled.\n");
+	fprintf(stderr, "	Thread count: %d\n", threadCount);
+	return 0;
+}
+
+int main(int argc, char **argv){
+	showWelcome();
+	if (processArguments(argc, argv)){
+		showUsage();
+		return 0;
+	}
+	
+	ExonList *exonList = new ExonList;
+	if (exonList -> readExon(referenceFileName.c_str(), 1)){
+		fprintf(stderr, "Cannot open reference file: %s.\n", referenceFileName.c_str());
+		exit(1);
+	}
+	CSRHash *hashExon = CSRHash::build(exonList, hashBinarySize, pieceSize, threadCount, windowSize);
+	CSRHash *halfHash = isSplitKey ? SplitKeyHash::buildHalfHash(exonList, hashBinarySize, pieceSize, threadCount) : 0;
+	if (MatchIndex::write(outputFileName.c_str(), exonList, hashExon, pieceSize, hashBinarySize, windowSize, halfHash)){
+		fprintf(stderr, "Cannot write index file: %s.\n", outputFileName.c_str());
+		exit(1);
+	}
+	fprintf(stderr, "Index written to %s.\n", outputFileName.c_str());
+	
+	delete halfHash;
+	delete hashExon;
+	delete exonList;
+	return 0;
+}
@@ -0,0 +1,347 @@
+/*******************************************************************************
+ * This file is part of SAP.
+ * 
+ * SAP is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * SAP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with SAP.  If not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************/
+
+
+
+#include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+
+#include "MappingFile.h"
+#include "String.h"
+
+#define MAPPING_TAB_COUNT 5
+
+/*
+* static functions
+*/
+static const char OP_CHARS[] = "cnid";
+static const char BASE_CHARS[] = "atgc";
+
+static inline int putVarint(unsigned long x, char *s){
+	int ret = 0;
+	for (; x >= 128; x >>= 7) s[ret ++] = (char)(x | 128);
+	s[ret ++] = (char)x;
+	return ret;
+}
+
+/*
+* Returns 0 when the varint does not end before end
+*/
+static inline bool getVarint(const char *&s, const char *end, unsigned long &x){
+	x = 0;
+	for (int shift = 0; s < end && shift < 64; shift += 7){
+		unsigned char c = *s ++;
+		x |= (unsigned long)(c & 127) << shift;
+		if (!(c & 128)) return 1;
+	}
+	return 0;
+}
+
+static inline int baseCode(char c){
+	switch (c){
+		case 'a': return 0;
+		case 't': return 1;
+		case 'g': return 2;
+		case 'c': return 3;
+		default: return -1;
+	}
+}
+
+static inline int opCode(char c){
+	switch (c){
+		case 'c': return 0;
+		case 'n': return 1;
+		case 'i': return 2;
+		default: return 3;
+	}
+}
+
+/*
+* Namespace MappingFile
+*/
+int MappingFile::putHeader(ExonList *list, DynamicArray <char> &s){
+	int size = MAPPING_FILE_MAGIC_SIZE + 1 + 5, count = 0;
+	for (ExonList::iterator it = list -> begin(); !it.isEnd(); it ++){
+		size += 10 + strlen(it.exon() -> name());
+		count ++;
+	}
+	if ((unsigned)size > s.size()) s.resize(size);
+	char *p = s.data();
+	memcpy(p, MAPPING_FILE_MAGIC, MAPPING_FILE_MAGIC_SIZE); p += MAPPING_FILE_MAGIC_SIZE;
+	*p ++ = MAPPING_FILE_VERSION;
+	p += putVarint(count, p);
+	for (ExonList::iterator it = list -> begin(); !it.isEnd(); it ++){
+		int nameSize = strlen(it.exon() -> name());
+		p += putVarint(it.exon() -> id(), p);
+		p += putVarint(nameSize, p);
+		memcpy(p, it.exon() -> name(), nameSize); p += nameSize;
+	}
+	return p - s.data();
+}
+
+int MappingFile::maxReadSize(int size){
+	return 14 + size * 6 + ((size + 3) >> 2);
+}
+
+int MappingFile::putRead(const char *dna, const char *quality, int size, char *s){
+	int ret = 4, nCount = 0;
+	ret += putVarint(size, s + ret);
+	for (int i = 0; i < size; i ++) if (baseCode(dna[i]) == -1) nCount ++;
+	ret += putVarint(nCount, s + ret);
+	for (int i = 0, last = 0; i < size; i ++){
+		if (baseCode(dna[i]) != -1) continue;
+		ret += putVarint(i - last, s + ret);
+		last = i;
+	}
+	char *packed = s + ret;
+	unsigned packedSize = ((unsigned)size + 3) >> 2;
+	memset(packed, 0, packedSize);
+	for (int i = 0; i < size; i ++){
+		int c = baseCode(dna[i]);
+		if (c > 0) packed[i >> 2] |= c << ((i & 3) << 1);
+	}
+	ret += packedSize;
+	memcpy(s + ret, quality, size);
+	return ret + size;
+}
+
+int MappingFile::maxMappingSize(int opCount){
+	return 31 + opCount * 5;
+}
+
+/*
+* The score is rounded as in the text output, to 4 decimals towards 0
+*/
+int MappingFile::putMapping(int referenceId, bool isReversed, int readLoc, int referenceLoc, double score, const char *ops, int opCount, char *s){
+	if (score < 0.0) score = 0.0;
+	int ret = putVarint(referenceId, s);
+	s[ret ++] = isReversed;
+	ret += putVarint(readLoc, s + ret);
+	ret += putVarint(referenceLoc, s + ret);
+	ret += putVarint((int)(score * MAPPING_SCORE_SCALE), s + ret);
+	int runCount = 0;
+	for (int i = 0; i < opCount; i ++) if (i == 0 || ops[i] != ops[i - 1]) runCount ++;
+	ret += putVarint(runCount, s + ret);
+	for (int i = 0, r; i < opCount; i = r){
+		for (r = i + 1; r < opCount && ops[r] == ops[i]; r ++);
+		ret += putVarint(((unsigned long)(r - i) << 2) | opCode(ops[i]), s + ret);
+	}
+	return ret;
+}
+
+void MappingFile::finishRecord(char *record, unsigned size){
+	size -= 4;
+	for (int i = 0; i < 4; i ++, size >>= 8) record[i] = (char)(size & 255);
+}
+
+
+/*
+* Class MappingReader
+*/
+MappingReader::MappingReader(IO::FileReader *reader) : _reader(reader), _isBinary(0){
+}
+
+MappingReader::~MappingReader(){
+	delete _reader;
+}
+
+MappingReader *MappingReader::newMappingReader(const char *fileName){
+	IO::FileReader *reader = IO::newFileReader(fileName);
+	if (!reader -> isOpen()){
+		delete reader;
+		return 0;
+	}
+	MappingReader *ret = new MappingReader(reader);
+	if (reader -> peekChar() == 0){
+		ret -> _isBinary = 1;
+		if (!ret -> readHeader_p()){
+			delete ret;
+			return 0;
+		}
+	}
+	return ret;
+}
+
+bool MappingReader::next(Record &record){
+	_mappings.clear();
+	_runs.clear();
+	if (!(_isBinary ? nextBinary_p(record) : nextText_p(record))) return 0;
+	record.mappings = _mappings.empty() ? 0 : &_mappings[0];
+	record.mappingCount = _mappings.size();
+	record.runs = _runs.empty() ? 0 : &_runs[0];
+	return 1;
+}
+
+const char *MappingReader::referenceName(int referenceId) const{
+	if (referenceId < 0 || referenceId >= (int)_referenceNames.size()) return 0;
+	return _referenceNames[referenceId].c_str();
+}
+
+bool MappingReader::readHeader_p(){
+	const char *magic = _reader -> nextBlock(MAPPING_FILE_MAGIC_SIZE);
+	if (!magic || memcmp(magic, MAPPING_FILE_MAGIC, MAPPING_FILE_MAGIC_SIZE)) return 0;
+	if (_reader -> nextChar() != MAPPING_FILE_VERSION) return 0;
+	unsigned long count, id, nameSize;
+	if (!readVarint_p(count)) return 0;
+	for (unsigned long i = 0; i < count; i ++){
+		if (!readVarint_p(id) || !readVarint_p(nameSize)) return 0;
+		const char *name = nameSize ? _reader -> nextBlock(nameSize) : "";
+		if (!name) return 0;
+		if (id >= _referenceNames.size()) _referenceNames.resize(id + 1);
+		_referenceNames[id].assign(name, nameSize);
+	}
+	return 1;
+}
+
+/*
+* The header is small, its varints are taken one char at a time
+*/
+bool MappingReader::readVarint_p(unsigned long &x){
+	x = 0;
+	for (int shift = 0, c = 128; c & 128; shift += 7){
+		if ((c = _reader -> nextChar()) == EOF) return 0;
+		x |= (unsigned long)(c & 127) << shift;
+	}
+	return 1;
+}
+
+/*
+* Every field is checked against the end of the record. A record that is cut short, places an 'n' outside the read,
+* names a reference missing from the header or has a mapping whose runs take more bases than the read has
+* is rejected as the end of the input
+*/
+bool MappingReader::nextBinary_p(Record &record){
+	const char *block = _reader -> nextBlock(4);
+	if (!block) return 0;
+	unsigned size = 0;
+	for (int i = 3; i >= 0; i --) size = (size << 8) | (unsigned char)block[i];
+	const char *s = _reader -> nextBlock(size), *end = s + size;
+	if (!s) return 0;
+	
+	unsigned long dnaSize, nCount, x;
+	if (!getVarint(s, end, dnaSize) || !getVarint(s, end, nCount) || dnaSize >= INT_MAX || nCount > dnaSize) return 0;
+	const char *nLocs = s;
+	for (unsigned long i = 0, loc = 0; i < nCount; i ++){
+		if (!getVarint(s, end, x) || (loc += x) >= dnaSize) return 0;
+	}
+	unsigned long packedSize = (dnaSize + 3) >> 2;
+	if ((unsigned long)(end - s) < packedSize + dnaSize) return 0;
+	
+	record.dnaSize = dnaSize;
+	if ((unsigned)record.dnaSize >= _dna.size()) _dna.resize(record.dnaSize + 1);
+	for (int i = 0; i < record.dnaSize; i ++) _dna[i] = BASE_CHARS[(s[i >> 2] >> ((i & 3) << 1)) & 3];
+	for (unsigned long i = 0, loc = 0; i < nCount; i ++){
+		getVarint(nLocs, end, x);
+		_dna[loc += x] = 'n';
+	}
+	_dna[record.dnaSize] = 0;
+	s += packedSize;
+	record.dna = _dna.data();
+	record.quality = s;
+	s += dnaSize;
+	
+	while (s < end){
+		Mapping mapping;
+		unsigned long referenceId, readLoc, referenceLoc, score, runCount;
+		if (!getVarint(s, end, referenceId) || s == end) return 0;
+		mapping.isReversed = *s ++;
+		if (!getVarint(s, end, readLoc) || !getVarint(s, end, referenceLoc) || !getVarint(s, end, score) || !getVarint(s, end, runCount)) return 0;
+		if (referenceId >= _referenceNames.size() || readLoc > dnaSize || referenceLoc > INT_MAX || runCount > (unsigned long)(end - s)) return 0;
+		mapping.referenceId = referenceId;
+		mapping.readLoc = readLoc;
+		mapping.referenceLoc = referenceLoc;
+		mapping.score = score / (double)MAPPING_SCORE_SCALE;
+		mapping.runBegin = _runs.size();
+		for (unsigned long i = 0, length = readLoc; i < runCount; i ++){
+			if (!getVarint(s, end, x) || (x >> 2) > INT_MAX) return 0;
+			Run run;
+			run.op = OP_CHARS[x & 3];
+			run.length = x >> 2;
+			if (run.op != 'd' && (length += run.length) > dnaSize) return 0;
+			_runs.push_back(run);
+		}
+		mapping.runEnd = _runs.size();
+		_mappings.push_back(mapping);
+	}
+	return 1;
+}
+
+/*
+* A read of a text output is its DNA and quality lines, then one line per mapping and an empty line.
+* A read missing its empty line at the end of the input is dropped
+*/
+bool MappingReader::nextText_p(Record &record){
+	if ((record.dnaSize = _reader -> readLine(_dna)) == EOF) return 0;
+	if (_reader -> readLine(_quality) == EOF) return 0;
+	record.dna = _dna.data();
+	record.quality = _quality.data();
+	
+	int size, tabs[MAPPING_TAB_COUNT];
+	while ((size = _reader -> readLine(_line)) > 0){
+		if (String::findChars(_line.data(), size, '\t', tabs, MAPPING_TAB_COUNT) < MAPPING_TAB_COUNT) continue;
+		char *line = _line.data();
+		Mapping mapping;
+		line[tabs[0]] = 0;
+		std::map <std::string, int>::const_iterator it = _referenceIds.find(line);
+		if (it == _referenceIds.end()){
+			mapping.referenceId = _referenceNames.size();
+			_referenceIds[line] = mapping.referenceId;
+			_referenceNames.push_back(line);
+		}  else {
+			mapping.referenceId = it -> second;
+		}
+		mapping.isReversed = (line[tabs[0] + 1] != 'N');
+		mapping.readLoc = atoi(line + tabs[1] + 1);
+		mapping.referenceLoc = atoi(line + tabs[2] + 1);
+		mapping.score = strtod(line + tabs[3] + 1, 0);
+		mapping.runBegin = _runs.size();
+		addRuns_p(line + tabs[4] + 1, size - tabs[4] - 1);
+		mapping.runEnd = _runs.size();
+		_mappings.push_back(mapping);
+	}
+	return size == 0;
+}
+
+/*
+* The ops are either one char per base, or runs (CIGAR style, see Mapper -c) when they start with a digit
+*/
+void MappingReader::addRuns_p(const char *ops, int size){
+	if (size && ops[0] >= '0' && ops[0] <= '9'){
+		for (int i = 0; i < size; i ++){
+			Run run;
+			run.length = 0;
+			for (; i < size && ops[i] >= '0' && ops[i] <= '9'; i ++) run.length = run.length * 10 + ops[i] - '0';
+			if (i >= size) break;
+			switch (ops[i]){
+				case '=': case 'M': run.op = 'n'; break;
+				case 'X': run.op = 'c'; break;
+				case 'I': run.op = 'i'; break;
+				default: run.op = 'd';
+			}
+			_runs.push_back(run);
+		}
+		return;
+	}
+	for (int i = 0, r; i < size; i = r){
+		for (r = i + 1; r < size && ops[r] == ops[i]; r ++);
+		Run run;
+		run.op = ops[i];
+		run.length = r - i;
+		_runs.push_back(run);
+	}
+}
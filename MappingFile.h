@@ -0,0 +1,132 @@
+/*******************************************************************************
+ * This file is part of SAP.
+ * 
+ * SAP is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * SAP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with SAP.  If not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************/
+
+
+
+#ifndef MAPPINGFILE_H
+#define MAPPINGFILE_H
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "IO.h"
+#include "MatchStructures.h"
+
+#define MAPPING_FILE_MAGIC "\0SAPMAP"
+#define MAPPING_FILE_MAGIC_SIZE 8
+#define MAPPING_FILE_VERSION 1
+#define MAPPING_SCORE_SCALE 10000
+
+/*
+* The binary output of Mapper (-b):
+*	the magic (8 bytes, the first one is 0 so it never starts a text output), a version byte,
+*	the reference count and every reference as its id, name size and name, all varints
+* then every read as a record:
+*	the record size after itself (4 bytes, little-endian),
+*	the read size, the count of 'n' in the read and their distances from the previous one,
+*	the read packed in 2 bits per base ("atgc" as 0 to 3, the first base in the lowest bits), the quality line as it is,
+*	and its mappings up to the end of the record: reference id, strand (one byte, 1 when reversed), read location,
+*	reference location, score in 1/MAPPING_SCORE_SCALE, the run count and every run as (length << 2 | op)
+* The ops are the same as in the text output: 'c', 'n', 'i', 'd' are 0 to 3
+*/
+namespace MappingFile{
+	int putHeader(ExonList *list, DynamicArray <char> &s);
+	/*
+	* Returns the size of the header written at the beginning of s, s is grown when needed
+	*/
+	int maxReadSize(int size);
+	int putRead(const char *dna, const char *quality, int size, char *s);
+	/*
+	* The record size is left open, finishRecord() writes it once the mappings are appended
+	*/
+	int maxMappingSize(int opCount);
+	int putMapping(int referenceId, bool isReversed, int readLoc, int referenceLoc, double score, const char *ops, int opCount, char *s);
+	void finishRecord(char *record, unsigned size);
+	/*
+	* size counts the whole record, from the beginning of putRead() to the end of the last mapping
+	*/
+};
+
+/*
+* Streams the reads and their mappings out of a Mapper output, text or binary (told apart by the first char).
+* A binary input that is mapped is read in place, only the read itself is unpacked
+*/
+class MappingReader{
+	public:
+		struct Run{
+			char op;
+			int length;
+		};
+		
+		struct Mapping{
+			int referenceId;
+			bool isReversed;
+			int readLoc, referenceLoc;
+			double score;
+			int runBegin, runEnd;
+			/*
+			* The runs of the mapping are runs[runBegin] to runs[runEnd - 1] of the record
+			*/
+		};
+		
+		struct Record{
+			int dnaSize;
+			char *dna;
+			const char *quality;
+			const Mapping *mappings;
+			int mappingCount;
+			const Run *runs;
+		};
+		/*
+		* The DNA may be changed by the caller, the record stays valid until the next call of next()
+		*/
+		
+		~MappingReader();
+		
+		static MappingReader *newMappingReader(const char *fileName);
+		/*
+		* Returns 0 when the file cannot be opened or its header is broken
+		*/
+		bool next(Record &record);
+		/*
+		* Returns 0 at the end of the input, or at a broken record of a binary input
+		*/
+		const char *referenceName(int referenceId) const;
+		/*
+		* Reference ids of a text input are given in the order the names are first met, 0 for an unknown id
+		*/
+		
+	private:
+		MappingReader(IO::FileReader *reader);
+		
+		IO::FileReader *_reader;
+		bool _isBinary;
+		std::vector <std::string> _referenceNames;
+		std::map <std::string, int> _referenceIds;
+		DynamicArray <char> _dna, _quality, _line;
+		std::vector <Mapping> _mappings;
+		std::vector <Run> _runs;
+		
+		bool readHeader_p();
+		bool readVarint_p(unsigned long &x);
+		bool nextBinary_p(Record &record);
+		bool nextText_p(Record &record);
+		void addRuns_p(const char *ops, int size);
+};
+
+#endif
@@ -0,0 +1,335 @@
+/*******************************************************************************
+ * This file is part of SAP.
+ * 
+ * SAP is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * SAP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with SAP.  If not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************/
+
+
+
+#include <string.h>
+#include <algorithm>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "MatchAlignment.h"
+#include "String.h"
+
+#define DP_NEGATIVE_INFINITY ((int)0x80808080)
+#define EVEN_BITS 0x5555555555555555UL
+
+/*
+* static functions
+*/
+
+/*
+* Moves bit i of x to bit 2i
+*/
+static inline unsigned long spreadBits(unsigned long x){
+	x &= 0xFFFFFFFFUL;
+	x = (x | (x << 16)) & 0x0000FFFF0000FFFFUL;
+	x = (x | (x << 8)) & 0x00FF00FF00FF00FFUL;
+	x = (x | (x << 4)) & 0x0F0F0F0F0F0F0F0FUL;
+	x = (x | (x << 2)) & 0x3333333333333333UL;
+	return (x | (x << 1)) & EVEN_BITS;
+}
+
+/*
+* Class BandedAligner
+*/
+BandedAligner::BandedAligner() : 
+	_dpData(0), _dp(0), _nextData(0), _next(0), _window(0), _dataCapacity(0), _rowCapacity(0), _windowCapacity(0), _windowFrom(0){
+		_fillRow = fillRowScalar;
+#if defined(__x86_64__) || defined(__i386__)
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2")) _fillRow = fillRowAvx2;
+		else if (__builtin_cpu_supports("sse4.1")) _fillRow = fillRowSse41;
+#endif
+}
+
+BandedAligner::~BandedAligner(){
+	delete[] _dpData;
+	delete[] _dp;
+	delete[] _nextData;
+	delete[] _next;
+	delete[] _window;
+}
+
+int **BandedAligner::dp() const{
+	return _dp + 1;
+}
+
+char **BandedAligner::next() const{
+	return _next + 1;
+}
+
+/*
+* Rows bLeft - 1 to readSize + 1 are kept, row bLeft - 1 is never reached and row bLeft starts every alignment with 0
+* The reference is unpacked into a zero padded window, so that the vector loads never leave it
+*/
+int BandedAligner::fill(const char *read, int readSize, const Dna &ref, int left, int right, int bLeft, int delta, int &p1, int &p2){
+	int refFrom = - left, refTo = right - left;
+	int bd = delta << 1, stride = ((bd + 9) & ~7) + 8, rowCount = readSize - bLeft + 3;
+	int windowFrom = bLeft - delta, windowTo = readSize + stride;
+	reserve_p(rowCount * stride, readSize + 3, windowTo - windowFrom);
+	_windowFrom = windowFrom;
+	
+	for (int x = 0; x < readSize + 3; x ++){
+		int row = std::max(0, x - bLeft) * stride;
+		_dp[x] = _dpData + row;
+		_next[x] = _nextData + row;
+	}
+	int **dp = _dp + 1;
+	memset(_nextData, 255, rowCount * stride);
+	for (int k = 0; k < stride; k ++) dp[bLeft - 1][k] = DP_NEGATIVE_INFINITY;
+	memset(dp[bLeft], 0, sizeof(int) * stride);
+	
+	memset(_window, 0, windowTo - windowFrom);
+	int copyFrom = std::max(refFrom, windowFrom), copyTo = std::min(refTo, windowTo);
+	if (copyFrom < copyTo) ref.copy(left + copyFrom, left + copyTo, _window + copyFrom - windowFrom);
+	
+	int ret = 0;
+	p1 = bLeft, p2 = 0;
+	for (int j = bLeft + 1; j <= readSize; j ++){
+		int limit = std::min(bd, refTo - (j - bLeft));
+		if (limit < 0) break;
+		int kLo = refFrom - (j - 1) + delta, kHi = refTo - (j - 1) + delta;
+		int rowMax = _fillRow(dp[j - 1], dp[j], _window + (j - 1 - bLeft), (unsigned char)read[j - 1], kLo, kHi, limit, bd);
+		if (rowMax > ret){
+			int k = 0;
+			while (dp[j][k] != rowMax) k ++;
+			ret = rowMax, p1 = j, p2 = k;
+		}
+	}
+	return ret;
+}
+
+/*
+* Each frame remembers which of the four moves it tries next, the moves are tried in the same order as the
+* recursive search used to, and the reference is read from the padded window
+*/
+void BandedAligner::traceBack(const char *read, int p1, int p2, int delta){
+	int **dp = _dp + 1;
+	char **next = _next + 1;
+	int refShift = - _windowFrom - delta - 1;
+	TraceFrame frame = {p1, p2, 0};
+	_traceStack.clear();
+	_traceStack.push_back(frame);
+	while (!_traceStack.empty()){
+		int x = _traceStack.back().x, y = _traceStack.back().y;
+		char direction = -1;
+		frame.x = x, frame.y = y, frame.branch = 0;
+		switch (_traceStack.back().branch ++){
+			case 0:
+				if (x > 0 && dp[x - 1][y] == dp[x][y] && next[x - 1][y] == -1) frame.x --, direction = 0;
+				break;
+			case 1:
+				if (x > 0 && dp[x - 1][y] + matchBonus == dp[x][y] && next[x - 1][y] == -1 && read[x - 1] == _window[x + y + refShift])
+					frame.x --, direction = 0;
+				break;
+			case 2:
+				if (x > 0 && y < (delta << 1) && dp[x - 1][y + 1] - deletionPunishment == dp[x][y] && next[x - 1][y + 1] == -1)
+					frame.x --, frame.y ++, direction = 1;
+				break;
+			case 3:
+				if (y > 0 && dp[x][y - 1] - deletionPunishment == dp[x][y] && next[x][y - 1] == -1) frame.y --, direction = 2;
+				break;
+			default:
+				_traceStack.pop_back();
+		}
+		if (direction != -1){
+			next[frame.x][frame.y] = direction;
+			_traceStack.push_back(frame);
+		}
+	}
+}
+
+void BandedAligner::reserve_p(unsigned dataSize, unsigned rowCount, unsigned windowSize){
+	if (dataSize > _dataCapacity){
+		delete[] _dpData;
+		delete[] _nextData;
+		_dataCapacity = dataSize + (dataSize >> 1);
+		_dpData = new int[_dataCapacity];
+		_nextData = new char[_dataCapacity];
+		memset(_dpData, 0, sizeof(int) * _dataCapacity);
+	}
+	if (rowCount > _rowCapacity){
+		delete[] _dp;
+		delete[] _next;
+		_rowCapacity = rowCount + (rowCount >> 1);
+		_dp = new int*[_rowCapacity];
+		_next = new char*[_rowCapacity];
+	}
+	if (windowSize > _windowCapacity){
+		delete[] _window;
+		_windowCapacity = windowSize + (windowSize >> 1);
+		_window = new char[_windowCapacity];
+	}
+}
+
+/*
+* One row of the band: cur[k] = max(prev[k + 1] - deletionPunishment, prev[k] + bonus, cur[k - 1] - deletionPunishment),
+* the diagonal move only when kLo <= k < kHi, cells after limit are outside the band
+* Returns the maximum of the row
+*/
+int BandedAligner::fillRowScalar(const int *prev, int *cur, const char *ref, int c, int kLo, int kHi, int limit, int bd){
+	int ret = DP_NEGATIVE_INFINITY, last = DP_NEGATIVE_INFINITY;
+	for (int k = 0; k <= limit; k ++){
+		int v = std::max(DP_NEGATIVE_INFINITY, last - deletionPunishment);
+		if (k < bd) v = std::max(v, prev[k + 1] - deletionPunishment);
+		if (k >= kLo && k < kHi) v = std::max(v, prev[k] + ((unsigned char)ref[k] == c ? matchBonus : 0));
+		cur[k] = last = v;
+		ret = std::max(ret, v);
+	}
+	return ret;
+}
+
+/*
+* Class UngappedAligner
+*/
+UngappedAligner::UngappedAligner() : _readSize(0), _from(0){
+}
+
+void UngappedAligner::setRead(const char *read, int readSize){
+	_readSize = readSize;
+	_packed.resize(Dna::packedSize(readSize));
+	_nMask.resize(Dna::nMaskSize(readSize));
+	_packed.back() = _nMask.back() = 0;
+	String::packDna(read, readSize, &_packed[0], &_nMask[0]);
+}
+
+/*
+* A base mismatches when the 2 bit codes differ, or when only one side is 'n' (both are packed as 0),
+* the mismatches are kept as one bit per base at the even positions
+*/
+int UngappedAligner::compare(const Dna &ref, int left){
+	Dna read(-1, &_packed[0], &_nMask[0], _readSize);
+	_from = std::max(0, - left);
+	_mismatches.resize((_readSize - _from + 31) >> 5);
+	int ret = _readSize - _from;
+	for (int j = _from, b = 0; j < _readSize; j += 32, b ++){
+		unsigned long x = read.word(j) ^ ref.word(left + j);
+		unsigned long d = ((x | (x >> 1)) & EVEN_BITS) | spreadBits(read.nWord(j) ^ ref.nWord(left + j));
+		if (_readSize - j < 32) d &= (1UL << ((_readSize - j) << 1)) - 1;
+		_mismatches[b] = d;
+		ret -= __builtin_popcountl(d);
+	}
+	return ret;
+}
+
+int UngappedAligner::firstMatch() const{
+	for (int b = 0; b < _mismatches.size(); b ++){
+		unsigned long m = ~_mismatches[b] & EVEN_BITS;
+		int j = _from + (b << 5);
+		if (_readSize - j < 32) m &= (1UL << ((_readSize - j) << 1)) - 1;
+		if (m) return j + (__builtin_ctzl(m) >> 1);
+	}
+	return _readSize;
+}
+
+int UngappedAligner::lastMatch() const{
+	for (int b = (int)_mismatches.size() - 1; b >= 0; b --){
+		unsigned long m = ~_mismatches[b] & EVEN_BITS;
+		int j = _from + (b << 5);
+		if (_readSize - j < 32) m &= (1UL << ((_readSize - j) << 1)) - 1;
+		if (m) return j + ((63 - __builtin_clzl(m)) >> 1);
+	}
+	return _from - 1;
+}
+
+void UngappedAligner::writeOps(int from, int to, char *s) const{
+	memset(s, 'n', to - from + 1);
+	for (int b = (from - _from) >> 5; b < _mismatches.size() && _from + (b << 5) <= to; b ++){
+		for (unsigned long d = _mismatches[b]; d; d &= d - 1){
+			int j = _from + (b << 5) + (__builtin_ctzl(d) >> 1);
+			if (j >= from && j <= to) s[j - from] = 'c';
+		}
+	}
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/*
+* The deletions along the row are a prefix maximum with a linear decay, done with log-steps inside the register
+* and the last cell of the previous vector carried in
+*/
+__attribute__((target("sse4.1")))
+int BandedAligner::fillRowSse41(const int *prev, int *cur, const char *ref, int c, int kLo, int kHi, int limit, int bd){
+	const __m128i neg = _mm_set1_epi32(DP_NEGATIVE_INFINITY), bonus = _mm_set1_epi32(matchBonus), cv = _mm_set1_epi32(c);
+	const __m128i d1 = _mm_set1_epi32(deletionPunishment), d2 = _mm_set1_epi32(deletionPunishment << 1);
+	const __m128i decay = _mm_setr_epi32(deletionPunishment, deletionPunishment * 2, deletionPunishment * 3, deletionPunishment * 4);
+	const __m128i lo = _mm_set1_epi32(kLo - 1), hi = _mm_set1_epi32(kHi), bdv = _mm_set1_epi32(bd), lim = _mm_set1_epi32(limit);
+	__m128i kv = _mm_setr_epi32(0, 1, 2, 3), carry = neg, best = neg;
+	for (int k = 0; k <= limit; k += 4, kv = _mm_add_epi32(kv, _mm_set1_epi32(4))){
+		int r;
+		memcpy(&r, ref + k, sizeof(int));
+		__m128i match = _mm_and_si128(_mm_cmpeq_epi32(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(r)), cv), bonus);
+		__m128i ins = _mm_sub_epi32(_mm_loadu_si128((const __m128i *)(prev + k + 1)), d1);
+		__m128i diag = _mm_add_epi32(_mm_loadu_si128((const __m128i *)(prev + k)), match);
+		ins = _mm_blendv_epi8(neg, ins, _mm_cmplt_epi32(kv, bdv));
+		diag = _mm_blendv_epi8(neg, diag, _mm_and_si128(_mm_cmpgt_epi32(kv, lo), _mm_cmplt_epi32(kv, hi)));
+		__m128i v = _mm_max_epi32(ins, diag);
+		v = _mm_max_epi32(v, _mm_sub_epi32(_mm_alignr_epi8(v, neg, 12), d1));
+		v = _mm_max_epi32(v, _mm_sub_epi32(_mm_alignr_epi8(v, neg, 8), d2));
+		v = _mm_max_epi32(v, _mm_sub_epi32(carry, decay));
+		v = _mm_blendv_epi8(v, neg, _mm_cmpgt_epi32(kv, lim));
+		_mm_storeu_si128((__m128i *)(cur + k), v);
+		carry = _mm_shuffle_epi32(v, 0xFF);
+		best = _mm_max_epi32(best, v);
+	}
+	best = _mm_max_epi32(best, _mm_shuffle_epi32(best, 0x4E));
+	best = _mm_max_epi32(best, _mm_shuffle_epi32(best, 0xB1));
+	return _mm_cvtsi128_si32(best);
+}
+
+__attribute__((target("avx2")))
+int BandedAligner::fillRowAvx2(const int *prev, int *cur, const char *ref, int c, int kLo, int kHi, int limit, int bd){
+	const __m256i neg = _mm256_set1_epi32(DP_NEGATIVE_INFINITY), bonus = _mm256_set1_epi32(matchBonus), cv = _mm256_set1_epi32(c);
+	const __m256i d1 = _mm256_set1_epi32(deletionPunishment), d2 = _mm256_set1_epi32(deletionPunishment << 1);
+	const __m256i d4 = _mm256_set1_epi32(deletionPunishment << 2);
+	const __m256i decay = _mm256_mullo_epi32(_mm256_setr_epi32(1, 2, 3, 4, 5, 6, 7, 8), d1);
+	const __m256i shift1 = _mm256_setr_epi32(0, 0, 1, 2, 3, 4, 5, 6), shift2 = _mm256_setr_epi32(0, 0, 0, 1, 2, 3, 4, 5);
+	const __m256i shift4 = _mm256_setr_epi32(0, 0, 0, 0, 0, 1, 2, 3), last = _mm256_set1_epi32(7);
+	const __m256i lo = _mm256_set1_epi32(kLo - 1), hi = _mm256_set1_epi32(kHi), bdv = _mm256_set1_epi32(bd), lim = _mm256_set1_epi32(limit);
+	__m256i kv = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), carry = neg, best = neg;
+	for (int k = 0; k <= limit; k += 8, kv = _mm256_add_epi32(kv, _mm256_set1_epi32(8))){
+		__m256i match = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(ref + k)));
+		match = _mm256_and_si256(_mm256_cmpeq_epi32(match, cv), bonus);
+		__m256i ins = _mm256_sub_epi32(_mm256_loadu_si256((const __m256i *)(prev + k + 1)), d1);
+		__m256i diag = _mm256_add_epi32(_mm256_loadu_si256((const __m256i *)(prev + k)), match);
+		ins = _mm256_blendv_epi8(neg, ins, _mm256_cmpgt_epi32(bdv, kv));
+		diag = _mm256_blendv_epi8(neg, diag, _mm256_and_si256(_mm256_cmpgt_epi32(kv, lo), _mm256_cmpgt_epi32(hi, kv)));
+		__m256i v = _mm256_max_epi32(ins, diag);
+		v = _mm256_max_epi32(v, _mm256_sub_epi32(_mm256_blend_epi32(_mm256_permutevar8x32_epi32(v, shift1), neg, 0x01), d1));
+		v = _mm256_max_epi32(v, _mm256_sub_epi32(_mm256_blend_epi32(_mm256_permutevar8x32_epi32(v, shift2), neg, 0x03), d2));
+		v = _mm256_max_epi32(v, _mm256_sub_epi32(_mm256_blend_epi32(_mm256_permutevar8x32_epi32(v, shift4), neg, 0x0F), d4));
+		v = _mm256_max_epi32(v, _mm256_sub_epi32(carry, decay));
+		v = _mm256_blendv_epi8(v, neg, _mm256_cmpgt_epi32(kv, lim));
+		_mm256_storeu_si256((__m256i *)(cur + k), v);
+		carry = _mm256_permutevar8x32_epi32(v, last);
+		best = _mm256_max_epi32(best, v);
+	}
+	__m128i ret = _mm_max_epi32(_mm256_castsi256_si128(best), _mm256_extracti128_si256(best, 1));
+	ret = _mm_max_epi32(ret, _mm_shuffle_epi32(ret, 0x4E));
+	ret = _mm_max_epi32(ret, _mm_shuffle_epi32(ret, 0xB1));
+	return _mm_cvtsi128_si32(ret);
+}
+#else
+int BandedAligner::fillRowSse41(const int *prev, int *cur, const char *ref, int c, int kLo, int kHi, int limit, int bd){
+	return fillRowScalar(prev, cur, ref, c, kLo, kHi, limit, bd);
+}
+
+int BandedAligner::fillRowAvx2(const int *prev, int *cur, const char *ref, int c, int kLo, int kHi, int limit, int bd){
+	return fillRowScalar(prev, cur, ref, c, kLo, kHi, limit, bd);
+}
+#endif
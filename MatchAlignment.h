@@ -0,0 +1,106 @@
+/*******************************************************************************
+ * This file is part of SAP.
+ * 
+ * SAP is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * SAP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with SAP.  If not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************/
+
+
+
+#ifndef MATCHALIGNMENT_H
+#define MATCHALIGNMENT_H
+
+#include <vector>
+
+#include "MatchStructures.h"
+
+const int matchBonus = 20;
+const int deletionPunishment = 13;
+
+/*
+* Per-thread workspace of the banded DP used for gapped reads
+* Cell (j, k) pairs read[j] with ref[j + k - delta], k goes from 0 to 2 * delta
+* Rows are filled with SSE4.1 or AVX2 when the CPU has them, the values are the same as the scalar code
+*/
+class BandedAligner{
+	public:
+		BandedAligner();
+		~BandedAligner();
+		
+		/*
+		* Row j is aligned against ref from left + j - delta, only ref[0, right) is used, and the fill starts from row bLeft
+		* Returns the best score, the first cell (row by row) reaching it is put in p1, p2
+		*/
+		int fill(const char *read, int readSize, const Dna &ref, int left, int right, int bLeft, int delta, int &p1, int &p2);
+		/*
+		* Marks in next() every cell on a best path to (p1, p2) after fill(), with the direction it was reached from:
+		* 0 for a match or mismatch, 1 for an insertion, 2 for a deletion
+		* The cells are visited in depth-first order on an explicit stack, so long reads do not need a deep thread stack
+		*/
+		void traceBack(const char *read, int p1, int p2, int delta);
+		int **dp() const;
+		char **next() const;
+		
+	private:
+		struct TraceFrame{
+			int x, y, branch;
+		};
+		
+		typedef int (*FillRow)(const int *prev, int *cur, const char *ref, int c, int kLo, int kHi, int limit, int bd);
+		
+		int *_dpData, **_dp;
+		char *_nextData, **_next, *_window;
+		unsigned _dataCapacity, _rowCapacity, _windowCapacity;
+		int _windowFrom;
+		std::vector <TraceFrame> _traceStack;
+		FillRow _fillRow;
+		
+		void reserve_p(unsigned dataSize, unsigned rowCount, unsigned windowSize);
+		
+		static int fillRowScalar(const int *prev, int *cur, const char *ref, int c, int kLo, int kHi, int limit, int bd);
+		static int fillRowSse41(const int *prev, int *cur, const char *ref, int c, int kLo, int kHi, int limit, int bd);
+		static int fillRowAvx2(const int *prev, int *cur, const char *ref, int c, int kLo, int kHi, int limit, int bd);
+};
+
+/*
+* Per-thread workspace comparing a read with the reference on one diagonal, 32 bases per step on the packed forms
+*/
+class UngappedAligner{
+	public:
+		UngappedAligner();
+		
+		/*
+		* Packs the read, once per strand
+		*/
+		void setRead(const char *read, int readSize);
+		/*
+		* Compares read[max(0, -left), readSize) with ref from left on, left + readSize should be inside ref
+		* Returns the number of matching bases
+		*/
+		int compare(const Dna &ref, int left);
+		/*
+		* First and last matching position of the last compare()
+		*/
+		int firstMatch() const;
+		int lastMatch() const;
+		/*
+		* Writes 'n' (match) or 'c' (mismatch) for every position in [from, to] into s
+		*/
+		void writeOps(int from, int to, char *s) const;
+		
+	private:
+		std::vector <unsigned long> _packed, _nMask, _mismatches;
+		int _readSize, _from;
+};
+
+#endif
@@ -17,8 +17,33 @@
 
 
 
+#include <vector>
+#include <algorithm>
+#include <pthread.h>
+
 #include "MatchHash.h"
 
+#define BUILDING_WORK_SIZE 1048576
+/*
+* Number of k-mer starts handled by one building work item
+*/
+#define SORTING_WORK_SIZE 65536
+/*
+* Number of buckets sorted by one sorting work item
+*/
+#define LOOKUP_GROUP_SIZE 32
+/*
+* Number of keys whose buckets are prefetched together by a batched lookup
+*/
+#define EVEN_BITS 0x5555555555555555UL
+/*
+* The low bit of every base in a key
+*/
+#define INVALID_MINIMIZER_ORDER (~0UL)
+/*
+* Order of the k-mers which are never picked as minimizers
+*/
+
 /*
 * static functions
 */
@@ -48,6 +73,63 @@ static inline unsigned long specialDnaToInt(char c){
 	}
 }
 
+/*
+* The key of seq[start, end), taken from the packed words when the DNA is packed
+*/
+static inline unsigned long dnaHashValue(const Dna *seq, int start, int end){
+	if (!seq -> isPacked()) return Hash::calcHashValue(seq -> dna() + start, seq -> dna() + end, &specialDnaToInt);
+	unsigned long ret = seq -> word(start);
+	if (end - start < 32) ret &= (1UL << (end - start << 1)) - 1;
+	return ret;
+}
+
+/*
+* The number of 'n' in seq[start, start + size), size is at most 63
+*/
+static inline int dnaNCount(const Dna *seq, int start, int size){
+	if (seq -> isPacked()) return __builtin_popcountl(seq -> nWord(start) & ((1UL << size) - 1));
+	int ret = 0;
+	for (int i = 0; i < size; i ++)
+		if (seq -> dna()[start + i] == 'n') ret ++;
+	return ret;
+}
+
+static inline unsigned long align8(unsigned long x){
+	return (x + 7ULL) & ~7ULL;
+}
+
+static inline unsigned residualBytes(unsigned binSize, unsigned pieceSize){
+	unsigned bits = (pieceSize << 1) > binSize ? (pieceSize << 1) - binSize : 0;
+	if (bits == 0) return 0;
+	if (bits <= 8) return 1;
+	if (bits <= 16) return 2;
+	if (bits <= 32) return 4;
+	return 8;
+}
+
+/*
+* Finds the postings in [from, to) whose residual equals value, residuals in [from, to) are sorted
+*/
+template <class T>
+static inline void residualRange(const T *residuals, unsigned long &from, unsigned long &to, T value){
+	if (to - from <= 16){
+		while (from < to && residuals[from] < value) from ++;
+		unsigned long end = from;
+		while (end < to && residuals[end] == value) end ++;
+		to = end;
+	}  else {
+		std::pair <const T *, const T *> range = std::equal_range(residuals + from, residuals + to, value);
+		from = range.first - residuals;
+		to = range.second - residuals;
+	}
+}
+
+static bool residualLess(const std::pair <unsigned long, Hash::Hit> &a, const std::pair <unsigned long, Hash::Hit> &b){
+	if (a.first != b.first) return a.first < b.first;
+	if (a.second.seq != b.second.seq) return a.second.seq < b.second.seq;
+	return a.second.start < b.second.start;
+}
+
 /*
  * Hash
  */
@@ -73,6 +155,58 @@ unsigned long Hash::calcHashValue(const char *start, const char *end, unsigned l
 	return ret;
 }
 
+unsigned Hash::exactFind(const char *s, unsigned len, std::vector <Hit> &hits, unsigned maxOccurrence) const{
+	Result *res = exactFind(s, len);
+	unsigned count = 0;
+	for (Result *p = res; p; p = p -> next) count ++;
+	if (maxOccurrence && count > maxOccurrence){
+		deleteResult(res);
+		return 1;
+	}
+	for (Result *p = res; p; p = p -> next){
+		Hit hit = {p -> seq, p -> start};
+		hits.push_back(hit);
+	}
+	deleteResult(res);
+	return 0;
+}
+
+void Hash::exactFind(Lookup *lookups, unsigned count, unsigned len, std::vector <Hit> &hits, unsigned maxOccurrence) const{
+	for (unsigned i = 0; i < count; i ++){
+		lookups[i].from = hits.size();
+		lookups[i].skipped = exactFind(lookups[i].s, len, hits, maxOccurrence);
+		lookups[i].to = hits.size();
+	}
+}
+
+/*
+* Without a limit the mismatched keys are looked up together, otherwise one by one so that each of them can be skipped
+*/
+unsigned Hash::oneMismatchFind(const char *s, unsigned len, std::vector <Hit> &hits, unsigned maxOccurrence) const{
+	if (!maxOccurrence){
+		Result *res = oneMismatchFind(s, len);
+		for (Result *p = res; p; p = p -> next){
+			Hit hit = {p -> seq, p -> start};
+			hits.push_back(hit);
+		}
+		deleteResult(res);
+		return 0;
+	}
+	
+	char key[MAX_PIECE_SIZE];
+	unsigned ret = 0;
+	memcpy(key, s, len);
+	for (unsigned i = 0; i < len; i ++){
+		for (unsigned j = 0; j < 4; j ++){
+			if (dnaString[j] == s[i]) continue;
+			key[i] = dnaString[j];
+			ret += exactFind(key, len, hits, maxOccurrence);
+		}
+		key[i] = s[i];
+	}
+	return ret;
+}
+
 void Hash::deleteResult(MatchHash::Result *&res){
 	Result *next;
 	for (; res; res = next){
@@ -123,7 +257,7 @@ void MatchHash::insert(Dna *seq, int start, int end, unsigned long hashValue){
 }
 
 void MatchHash::remove(Dna *seq, int start, int end){
-	unsigned hashVal = Hash::calcHashValue(seq -> dna() + start, seq -> dna() + end, &specialDnaToInt);
+	unsigned long hashVal = dnaHashValue(seq, start, end);
 	remove_p(seq, start, hashVal);
 }
 
@@ -132,7 +266,7 @@ void MatchHash::remove(Dna *seq, int start, int, unsigned long hashValue){
 }
 
 MatchHash::HashElement::HashElement(Dna *seq, int start, int end) : next(0), seq(seq -> id()), start(start){
-	hashValue = Hash::calcHashValue(seq -> dna() + start, seq -> dna() + end, &specialDnaToInt);
+	hashValue = dnaHashValue(seq, start, end);
 }
 
 MatchHash::HashElement::HashElement(Dna *seq, int start, int end, unsigned long hashValue) : 
@@ -199,7 +333,7 @@ BufferedMatchHash::HashElement::HashElement() : next(0), seq(0){
 }
 
 BufferedMatchHash::HashElement::HashElement(Dna *seq, int start, int end) : next(0), seq(seq -> id()), start(start){
-	hashValue = Hash::calcHashValue(seq -> dna() + start, seq -> dna() + end, &specialDnaToInt);
+	hashValue = dnaHashValue(seq, start, end);
 }
 
 BufferedMatchHash::HashElement::HashElement(Dna *seq, int start, int end, unsigned long hashValue) : 
@@ -226,7 +360,7 @@ BinaryHash::~BinaryHash(){
 	delete[] _elements;
 }
 
-void BinaryHash::find_p(unsigned int hashVal, MatchHash::Result *&ret) const{
+void BinaryHash::find_p(unsigned long hashVal, MatchHash::Result *&ret) const{
 	unsigned long id = hashVal & _binAnd;
 	for (HashElement *e = _elements[id]; e; e = e -> next){
 		if (e -> hashValue == hashVal){
@@ -278,7 +412,7 @@ BufferedBinaryHash::BufferedBinaryHash(unsigned long hashSize, unsigned int binS
 }
 
 BufferedBinaryHash::~BufferedBinaryHash(){
-	delete[] _elements;
+	delete[] _elementBases;
 }
 
 void BufferedBinaryHash::find_p(unsigned long hashVal, MatchHash::Result *&ret) const{
@@ -298,3 +432,524 @@ void BufferedBinaryHash::insert_p(unsigned elementId){
 	_elementBases[id] = elementId;
 }
 
+void addToHash(Hash *hash, Dna *dna, int l, int r, int segmentSize){
+	if (dna -> isPacked()){
+		/*
+		* Same keys as the character version below, whose first key may end one base later than the others
+		*/
+		unsigned long nAnd = (1UL << segmentSize) - 1;
+		int last = r - segmentSize;
+		if (segmentSize <= r - l + 1) last = std::max(last, l);
+		for (int i = l; i <= last; i ++)
+			if (__builtin_popcountl(dna -> nWord(i) & nAnd) <= 2) hash -> insert(dna, i, i + segmentSize, dnaHashValue(dna, i, i + segmentSize));
+		return;
+	}
+	
+	unsigned long hashVal = 0;
+	int nCount = 0;
+	char *s = dna -> dna();
+	if (segmentSize <= r - l + 1){
+		for (int i = 0; i < segmentSize; i ++)
+			if (s[l + i] == 'n') nCount ++;
+		hashVal = Hash::calcHashValue(s + l, s + l + segmentSize, &specialDnaToInt);
+		if (nCount <= 2) hash -> insert(dna, l, l + segmentSize, hashVal);
+	}
+	for (int i = l + 1; i + segmentSize <= r; i ++){
+		if (s[i - 1] == 'n') nCount --;
+		if (s[i + segmentSize - 1] == 'n') nCount ++;
+		hashVal = (hashVal >> 2U) + (specialDnaToInt(s[i + segmentSize - 1]) << (segmentSize - 1 << 1ULL));
+		if (nCount <= 2) hash -> insert(dna, i, i + segmentSize, hashVal);
+	}
+}
+
+/*
+* SplitKeyHash
+*/
+SplitKeyHash::SplitKeyHash(ExonList *list, const Hash *hash, const CSRHash *halfHash, unsigned pieceSize) : 
+	_hash(hash), _halfHash(halfHash), _pieceSize(pieceSize), _halfSize(halfSize(pieceSize)){
+		for (ExonList::iterator it = list -> begin(); !it.isEnd(); it ++){
+			Dna *dna = it.exon();
+			if (dna -> id() >= (int)_dnas.size()) _dnas.resize(dna -> id() + 1, 0);
+			_dnas[dna -> id()] = dna;
+		}
+}
+
+SplitKeyHash::~SplitKeyHash(){
+}
+
+/*
+* The half hash holds every key of halfSize(pieceSize) bases, which is also long enough for the second half of an odd piece,
+* as a mismatch in the first half leaves the first halfSize bases of the second half exact.
+* The last base of an odd piece is in neither half, so a piece whose only mismatch is there is seen by both probes,
+* verify_p() keeps it only from the probe of the first half
+*/
+CSRHash *SplitKeyHash::buildHalfHash(ExonList *list, unsigned binSize, unsigned pieceSize, int threadCount){
+	unsigned half = halfSize(pieceSize);
+	return CSRHash::build(list, std::min(binSize, half << 1), half, threadCount);
+}
+
+unsigned SplitKeyHash::halfSize(unsigned pieceSize){
+	return pieceSize >> 1;
+}
+
+Hash::Result *SplitKeyHash::exactFind(const char *s, unsigned len) const{
+	return _hash -> exactFind(s, len);
+}
+
+Hash::Result *SplitKeyHash::oneMismatchFind(const char *s, unsigned len) const{
+	Result *ret = 0;
+	std::vector <Hit> hits;
+	oneMismatchFind(s, len, hits);
+	for (unsigned i = 0; i < hits.size(); i ++){
+		Result *res = new Result(hits[i].seq, hits[i].start);
+		res -> next = ret;
+		ret = res;
+	}
+	return ret;
+}
+
+unsigned SplitKeyHash::exactFind(const char *s, unsigned len, std::vector <Hit> &hits, unsigned maxOccurrence) const{
+	return _hash -> exactFind(s, len, hits, maxOccurrence);
+}
+
+void SplitKeyHash::exactFind(Lookup *lookups, unsigned count, unsigned len, std::vector <Hit> &hits, unsigned maxOccurrence) const{
+	_hash -> exactFind(lookups, count, len, hits, maxOccurrence);
+}
+
+/*
+* Finds the pieces of the reference which differ from s in exactly one base, len must be the piece size. 
+* With an occurrence limit, the hits are grouped by their keys to find the over-represented ones.
+*/
+unsigned SplitKeyHash::oneMismatchFind(const char *s, unsigned len, std::vector <Hit> &hits, unsigned maxOccurrence) const{
+	unsigned long hashVal = Hash::calcHashValue(s, s + len, &specialDnaToInt), halfAnd = (1UL << (_halfSize << 1)) - 1;
+	unsigned long from = hits.size();
+	verify_p(hashVal, hashVal & halfAnd, 0, hits);
+	verify_p(hashVal, (hashVal >> (_halfSize << 1)) & halfAnd, _halfSize, hits);
+	if (!maxOccurrence || hits.size() - from <= maxOccurrence) return 0;
+	
+	std::vector <std::pair <unsigned long, Hit> > found;
+	for (unsigned long i = from; i < hits.size(); i ++)
+		found.push_back(std::make_pair(dnaHashValue(_dnas[hits[i].seq], hits[i].start, hits[i].start + _pieceSize), hits[i]));
+	std::sort(found.begin(), found.end(), residualLess);
+	hits.resize(from);
+	unsigned ret = 0;
+	for (unsigned long i = 0, j; i < found.size(); i = j){
+		for (j = i + 1; j < found.size() && found[j].first == found[i].first; j ++);
+		if (j - i > maxOccurrence) ret ++;
+		else for (unsigned long k = i; k < j; k ++) hits.push_back(found[k].second);
+	}
+	return ret;
+}
+
+/*
+* Checks the pieces whose half at shift has the key halfHashVal, and keeps the ones which are in the hash of whole pieces
+* (see CSRHash::build() and addToHash()) and differ from hashVal in exactly one base.
+* The pieces whose first half is exact are left to the probe at 0, so that a piece is never kept twice (see halfSize())
+*/
+void SplitKeyHash::verify_p(unsigned long hashVal, unsigned long halfHashVal, int shift, std::vector <Hit> &hits) const{
+	unsigned long count, halfAnd = (1UL << (_halfSize << 1)) - 1;
+	const Hit *postings = _halfHash -> find(halfHashVal, count);
+	for (unsigned long i = 0; i < count; i ++){
+		const Dna *dna = _dnas[postings[i].seq];
+		int start = postings[i].start - shift;
+		int last = dna -> size() < _pieceSize ? -1 : std::max(0, (int)dna -> size() - 1 - (int)_pieceSize);
+		if (start < 0 || start > last) continue;
+		unsigned long x = dnaHashValue(dna, start, start + _pieceSize) ^ hashVal;
+		if (__builtin_popcountl((x | (x >> 1)) & EVEN_BITS) != 1 || dnaNCount(dna, start, _pieceSize) > 2) continue;
+		if (shift && !(x & halfAnd)) continue;
+		Hit hit = {postings[i].seq, start};
+		hits.push_back(hit);
+	}
+}
+
+void SplitKeyHash::insert(Dna *seq, int start, int end){
+}
+
+void SplitKeyHash::insert(Dna *seq, int start, int end, unsigned long hashValue){
+}
+
+void SplitKeyHash::remove(Dna *seq, int start, int end){
+}
+
+void SplitKeyHash::remove(Dna *seq, int start, int end, unsigned long hashValue){
+}
+
+/*
+* MinimizerSampler
+*/
+MinimizerSampler::MinimizerSampler(unsigned pieceSize, unsigned windowSize) : 
+	_keyAnd((1ULL << (pieceSize << 1)) - 1), _pieceSize(pieceSize), _windowSize(windowSize){
+}
+
+MinimizerSampler::~MinimizerSampler(){
+}
+
+void MinimizerSampler::sample(const char *s, int size, std::vector <int> &locs){
+	int count = size - (int)_pieceSize + 1;
+	if (count <= 0) return;
+	_orders.resize(count);
+	unsigned long hashVal = Hash::calcHashValue(s, s + _pieceSize, &specialDnaToInt);
+	int nCount = 0;
+	for (unsigned i = 0; i < _pieceSize; i ++)
+		if (s[i] == 'n') nCount ++;
+	_orders[0] = order(hashVal, nCount);
+	for (int i = 1; i < count; i ++){
+		if (s[i - 1] == 'n') nCount --;
+		if (s[i + _pieceSize - 1] == 'n') nCount ++;
+		hashVal = (hashVal >> 2U) + (specialDnaToInt(s[i + _pieceSize - 1]) << (_pieceSize - 1 << 1ULL));
+		_orders[i] = order(hashVal, nCount);
+	}
+	winnow(std::max(1, count - (int)_windowSize + 1), 0, 0, locs);
+}
+
+/*
+* The window starting at from - 1 is evaluated as well, only to skip the minimizer it has already picked
+*/
+void MinimizerSampler::sample(const Dna *dna, int from, int to, int last, std::vector <int> &locs){
+	int lastWindow = std::max(0, last - (int)_windowSize + 1);
+	if (from > lastWindow) return;
+	int base = std::max(0, from - 1), end = std::min(last, std::min(to, lastWindow) + (int)_windowSize - 1);
+	_orders.resize(end - base + 1);
+	for (int i = base; i <= end; i ++) _orders[i - base] = order(dnaHashValue(dna, i, i + _pieceSize), dnaNCount(dna, i, _pieceSize));
+	winnow(std::min(to, lastWindow) - base + 1, from - base, base, locs);
+}
+
+/*
+* An invertible mix of the 2 * pieceSize key bits
+*/
+unsigned long MinimizerSampler::order(unsigned long key, int nCount) const{
+	if (nCount > 2) return INVALID_MINIMIZER_ORDER;
+	key = (~key + (key << 21)) & _keyAnd;
+	key = key ^ key >> 24;
+	key = (key + (key << 3) + (key << 8)) & _keyAnd;
+	key = key ^ key >> 14;
+	key = (key + (key << 2) + (key << 4)) & _keyAnd;
+	key = key ^ key >> 28;
+	key = (key + (key << 31)) & _keyAnd;
+	return key;
+}
+
+/*
+* Slides a window of _windowSize orders over _orders with a monotonic queue, whose head is the leftmost minimum. 
+* The minimizers only move right, so a minimizer is new when it differs from the one of the previous window.
+*/
+void MinimizerSampler::winnow(int windowCount, int skip, int base, std::vector <int> &locs){
+	int count = _orders.size(), next = 0, previous = -1;
+	unsigned head = 0;
+	_queue.clear();
+	for (int w = 0; w < windowCount; w ++){
+		for (int end = std::min(w + (int)_windowSize, count); next < end; next ++){
+			while (_queue.size() > head && _orders[_queue.back()] > _orders[next]) _queue.pop_back();
+			_queue.push_back(next);
+		}
+		while (_queue[head] < w) head ++;
+		int m = _queue[head];
+		if (w >= skip && m != previous && _orders[m] != INVALID_MINIMIZER_ORDER) locs.push_back(base + m);
+		previous = m;
+	}
+}
+
+/*
+* CSRHash
+*/
+CSRHash::CSRHash(unsigned binSize, unsigned pieceSize) : 
+	_binSize(binSize), _binAnd((1ULL << binSize) - 1), _size(1ULL << binSize), _count(0), 
+	_pieceSize(pieceSize), _residualBytes(residualBytes(binSize, pieceSize)), _isCounting(1), _isMapped(0), 
+	_postings(0), _residuals(0){
+		_offsets = new unsigned[_size + 1];
+		memset(_offsets, 0, sizeof(unsigned) * (_size + 1));
+}
+
+CSRHash::CSRHash(const char *image) : _isCounting(0), _isMapped(1){
+	const unsigned long *header = (const unsigned long *)image;
+	_binSize = header[0];
+	_pieceSize = header[1];
+	_count = header[2];
+	_residualBytes = header[3];
+	_binAnd = (1ULL << _binSize) - 1;
+	_size = 1ULL << _binSize;
+	
+	unsigned long loc = sizeof(unsigned long) << 2;
+	_offsets = (unsigned *)(image + loc);
+	loc = align8(loc + sizeof(unsigned) * (_size + 1));
+	_postings = (Hit *)(image + loc);
+	_residuals = (unsigned char *)(image + loc + sizeof(Hit) * _count);
+}
+
+CSRHash::~CSRHash(){
+	if (_isMapped) return;
+	delete[] _offsets;
+	delete[] _postings;
+	delete[] _residuals;
+}
+
+/*
+* Every exon is cut into work items of BUILDING_WORK_SIZE k-mer starts, which are claimed by the threads of each pass
+*/
+CSRHash *CSRHash::build(ExonList *list, unsigned binSize, unsigned pieceSize, int threadCount, unsigned windowSize){
+	CSRHash *ret = new CSRHash(binSize, pieceSize);
+	std::vector <BuildingWork> works;
+	for (ExonList::iterator it = list -> begin(); !it.isEnd(); it ++){
+		Dna *dna = it.exon();
+		if (dna -> size() < pieceSize) continue;
+		int lastStart = std::max(0, (int)dna -> size() - 1 - (int)pieceSize);
+		for (int from = 0; from <= lastStart; from += BUILDING_WORK_SIZE){
+			BuildingWork work = {dna, from, std::min(lastStart, from + BUILDING_WORK_SIZE - 1), lastStart};
+			works.push_back(work);
+		}
+	}
+	
+	BuildingArg arg = {ret, &works, 0, windowSize};
+	runThreads(threadCount, buildingProcess, &arg);
+	ret -> finishCounting();
+	arg.next = 0;
+	runThreads(threadCount, buildingProcess, &arg);
+	ret -> finishBuilding(threadCount);
+	return ret;
+}
+
+Hash::Result *CSRHash::exactFind(const char *s, unsigned len) const{
+	Result *ret = 0;
+	find_p(Hash::calcHashValue(s, s + len, &specialDnaToInt), ret);
+	return ret;
+}
+
+Hash::Result *CSRHash::oneMismatchFind(const char *s, unsigned len) const{
+	Result *ret = 0;
+	unsigned long hashVal = Hash::calcHashValue(s, s + len, &specialDnaToInt);
+	for (unsigned i = 0, movLen = 0; i < len; i ++, movLen += 2){
+		hashVal -= (specialDnaToInt(s[i]) << movLen);
+		for (unsigned j = 0;; j ++){
+			if (dnaString[j] != s[i]) find_p(hashVal, ret);
+			if (j < 3) hashVal += (1ULL << movLen);
+			else break;
+		}
+		hashVal -= (3ULL - specialDnaToInt(s[i]) << movLen);
+	}
+	return ret;
+}
+
+unsigned CSRHash::exactFind(const char *s, unsigned len, std::vector <Hit> &hits, unsigned maxOccurrence) const{
+	return find_p(Hash::calcHashValue(s, s + len, &specialDnaToInt), hits, maxOccurrence);
+}
+
+/*
+* Keys are resolved LOOKUP_GROUP_SIZE at a time in three passes: the first prefetches the offsets of their buckets, 
+* the second the first residuals and postings of the buckets, the third finds the postings. The misses of a group 
+* are then waited for together instead of one after another.
+*/
+void CSRHash::exactFind(Lookup *lookups, unsigned count, unsigned len, std::vector <Hit> &hits, unsigned maxOccurrence) const{
+	unsigned long hashVals[LOOKUP_GROUP_SIZE];
+	for (unsigned base = 0; base < count; base += LOOKUP_GROUP_SIZE){
+		unsigned size = std::min(count - base, (unsigned)LOOKUP_GROUP_SIZE);
+		Lookup *group = lookups + base;
+		for (unsigned i = 0; i < size; i ++){
+			hashVals[i] = Hash::calcHashValue(group[i].s, group[i].s + len, &specialDnaToInt);
+			__builtin_prefetch(_offsets + (hashVals[i] & _binAnd));
+		}
+		for (unsigned i = 0; i < size; i ++){
+			unsigned from = _offsets[hashVals[i] & _binAnd];
+			__builtin_prefetch(_residuals + (unsigned long)from * _residualBytes);
+			__builtin_prefetch(_postings + from);
+		}
+		for (unsigned i = 0; i < size; i ++){
+			group[i].from = hits.size();
+			group[i].skipped = find_p(hashVals[i], hits, maxOccurrence);
+			group[i].to = hits.size();
+		}
+	}
+}
+
+unsigned CSRHash::oneMismatchFind(const char *s, unsigned len, std::vector <Hit> &hits, unsigned maxOccurrence) const{
+	unsigned long hashVal = Hash::calcHashValue(s, s + len, &specialDnaToInt);
+	unsigned ret = 0;
+	for (unsigned i = 0, movLen = 0; i < len; i ++, movLen += 2){
+		hashVal -= (specialDnaToInt(s[i]) << movLen);
+		for (unsigned j = 0;; j ++){
+			if (dnaString[j] != s[i]) ret += find_p(hashVal, hits, maxOccurrence);
+			if (j < 3) hashVal += (1ULL << movLen);
+			else break;
+		}
+		hashVal -= (3ULL - specialDnaToInt(s[i]) << movLen);
+	}
+	return ret;
+}
+
+void CSRHash::insert(Dna *seq, int start, int end){
+	insert(seq, start, end, dnaHashValue(seq, start, end));
+}
+
+void CSRHash::insert(Dna *seq, int start, int, unsigned long hashValue){
+	unsigned long id = hashValue & _binAnd;
+	if (_isCounting){
+		__sync_fetch_and_add(_offsets + id + 1, 1);
+		return;
+	}
+	unsigned loc = __sync_fetch_and_add(_offsets + id, 1);
+	_postings[loc].seq = seq -> id();
+	_postings[loc].start = start;
+	setResidual(loc, hashValue >> _binSize);
+}
+
+void CSRHash::remove(Dna *seq, int start, int end){
+}
+
+void CSRHash::remove(Dna *seq, int start, int end, unsigned long hashValue){
+}
+
+const Hash::Hit *CSRHash::find(unsigned long hashValue, unsigned long &count) const{
+	unsigned long from, to;
+	equalRange_p(hashValue, from, to);
+	count = to - from;
+	return _postings + from;
+}
+
+void CSRHash::finishCounting(){
+	for (unsigned long i = 0; i < _size; i ++) _offsets[i + 1] += _offsets[i];
+	_count = _offsets[_size];
+	_postings = new Hit[_count];
+	_residuals = new unsigned char[_count * _residualBytes + 1];
+	_isCounting = 0;
+}
+
+/*
+* After filling, _offsets[b] is the end of bucket b, shift it back to the start and sort every bucket
+*/
+void CSRHash::finishBuilding(int threadCount){
+	memmove(_offsets + 1, _offsets, sizeof(unsigned) * _size);
+	_offsets[0] = 0;
+	
+	BuildingArg arg = {this, 0, 0, 0};
+	runThreads(threadCount, sortingProcess, &arg);
+}
+
+void *CSRHash::buildingProcess(void *arg){
+	BuildingArg *args = (BuildingArg *)arg;
+	const std::vector <BuildingWork> &works = *args -> works;
+	unsigned pieceSize = args -> hash -> _pieceSize;
+	if (args -> windowSize){
+		MinimizerSampler sampler(pieceSize, args -> windowSize);
+		std::vector <int> locs;
+		for (unsigned long i; (i = __sync_fetch_and_add(&args -> next, 1)) < works.size();){
+			Dna *dna = works[i].dna;
+			locs.clear();
+			sampler.sample(dna, works[i].from, works[i].to, works[i].last, locs);
+			for (unsigned j = 0; j < locs.size(); j ++)
+				args -> hash -> insert(dna, locs[j], locs[j] + pieceSize, dnaHashValue(dna, locs[j], locs[j] + pieceSize));
+		}
+		return 0;
+	}
+	for (unsigned long i; (i = __sync_fetch_and_add(&args -> next, 1)) < works.size();)
+		addToHash(args -> hash, works[i].dna, works[i].from, works[i].to + pieceSize, pieceSize);
+	return 0;
+}
+
+void *CSRHash::sortingProcess(void *arg){
+	BuildingArg *args = (BuildingArg *)arg;
+	CSRHash *hash = args -> hash;
+	for (unsigned long i; (i = __sync_fetch_and_add(&args -> next, SORTING_WORK_SIZE)) < hash -> _size;)
+		hash -> sortBuckets_p(i, std::min(hash -> _size, i + SORTING_WORK_SIZE));
+	return 0;
+}
+
+void CSRHash::runThreads(int threadCount, void *(*process)(void *), BuildingArg *arg){
+	if (threadCount <= 1){
+		process(arg);
+		return;
+	}
+	pthread_t *threads = new pthread_t[threadCount];
+	for (int i = 0; i < threadCount; i ++) pthread_create(&threads[i], NULL, process, (void *)arg);
+	for (int i = 0; i < threadCount; i ++) pthread_join(threads[i], NULL);
+	delete[] threads;
+}
+
+/*
+* Sort the postings of buckets [from, to) by (residual, seq, start), which is the order of a serial build
+*/
+void CSRHash::sortBuckets_p(unsigned long from, unsigned long to){
+	std::vector <std::pair <unsigned long, Hit> > bucket;
+	for (unsigned long b = from; b < to; b ++){
+		unsigned long start = _offsets[b], end = _offsets[b + 1];
+		bool isSorted = 1;
+		for (unsigned long i = start + 1; i < end && isSorted; i ++){
+			std::pair <unsigned long, Hit> p1(residual(i - 1), _postings[i - 1]), p2(residual(i), _postings[i]);
+			if (residualLess(p2, p1)) isSorted = 0;
+		}
+		if (isSorted) continue;
+		
+		bucket.clear();
+		for (unsigned long i = start; i < end; i ++) bucket.push_back(std::make_pair(residual(i), _postings[i]));
+		std::sort(bucket.begin(), bucket.end(), residualLess);
+		for (unsigned long i = start; i < end; i ++){
+			setResidual(i, bucket[i - start].first);
+			_postings[i] = bucket[i - start].second;
+		}
+	}
+}
+
+unsigned long CSRHash::imageSize() const{
+	return align8(align8((sizeof(unsigned long) << 2) + sizeof(unsigned) * (_size + 1)) + sizeof(Hit) * _count + _residualBytes * _count);
+}
+
+/*
+* Image layout: binSize, pieceSize, count, residualBytes, _offsets[size + 1], padding, _postings[count], _residuals, padding
+*/
+void CSRHash::writeImage(FILE *f) const{
+	unsigned long header[4] = {_binSize, _pieceSize, _count, _residualBytes};
+	fwrite(header, sizeof(unsigned long), 4, f);
+	fwrite(_offsets, sizeof(unsigned), _size + 1, f);
+	unsigned long loc = (sizeof(unsigned long) << 2) + sizeof(unsigned) * (_size + 1);
+	for (; loc < align8(loc); loc ++) fputc(0, f);
+	fwrite(_postings, sizeof(Hit), _count, f);
+	fwrite(_residuals, _residualBytes, _count, f);
+	for (loc += sizeof(Hit) * _count + _residualBytes * _count; loc < imageSize(); loc ++) fputc(0, f);
+}
+
+void CSRHash::find_p(unsigned long hashVal, Result *&ret) const{
+	unsigned long from, to;
+	equalRange_p(hashVal, from, to);
+	for (unsigned long i = from; i < to; i ++){
+		Result *res = new Result(_postings[i].seq, _postings[i].start);
+		res -> next = ret;
+		ret = res;
+	}
+}
+
+unsigned CSRHash::find_p(unsigned long hashVal, std::vector <Hit> &hits, unsigned maxOccurrence) const{
+	unsigned long from, to;
+	equalRange_p(hashVal, from, to);
+	if (maxOccurrence && to - from > maxOccurrence) return 1;
+	hits.insert(hits.end(), _postings + from, _postings + to);
+	return 0;
+}
+
+void CSRHash::equalRange_p(unsigned long hashVal, unsigned long &from, unsigned long &to) const{
+	unsigned long id = hashVal & _binAnd, value = hashVal >> _binSize;
+	from = _offsets[id];
+	to = _offsets[id + 1];
+	switch (_residualBytes){
+		case 1: residualRange((const unsigned char *)_residuals, from, to, (unsigned char)value); break;
+		case 2: residualRange((const unsigned short *)_residuals, from, to, (unsigned short)value); break;
+		case 4: residualRange((const unsigned *)_residuals, from, to, (unsigned)value); break;
+		case 8: residualRange((const unsigned long *)_residuals, from, to, (unsigned long)value); break;
+	}
+}
+
+unsigned long CSRHash::residual(unsigned long i) const{
+	switch (_residualBytes){
+		case 1: return _residuals[i];
+		case 2: return ((const unsigned short *)_residuals)[i];
+		case 4: return ((const unsigned *)_residuals)[i];
+		case 8: return ((const unsigned long *)_residuals)[i];
+	}
+	return 0;
+}
+
+void CSRHash::setResidual(unsigned long i, unsigned long value){
+	switch (_residualBytes){
+		case 1: _residuals[i] = value; break;
+		case 2: ((unsigned short *)_residuals)[i] = value; break;
+		case 4: ((unsigned *)_residuals)[i] = value; break;
+		case 8: ((unsigned long *)_residuals)[i] = value; break;
+	}
+}
@@ -22,6 +22,9 @@
 #ifndef _HASH_H
 #define _HASH_H
 
+#include <cstdio>
+#include <vector>
+
 #include "MatchStructures.h"
 
 #define HASH_NODE_SIZE 5
@@ -32,6 +35,10 @@
 /*
 * Defines the maximum size of MatchHash
 */
+#define MAX_PIECE_SIZE 31
+/*
+* Defines the maximum length of a key, keys take 2 bits per base in an unsigned long
+*/
 
 /*
 * A virtual class
@@ -47,6 +54,17 @@ class Hash{
 			Result(int seq, int start);
 		};
 		
+		struct Hit{
+			int seq;
+			int start;
+		};
+		
+		struct Lookup{
+			const char *s;
+			unsigned long from, to;		//Range of the hits of s, filled by the lookup
+			unsigned skipped;
+		};
+		
 	public:
 		Hash();
 		~Hash();
@@ -56,6 +74,17 @@ class Hash{
 		
 		virtual Result* exactFind(const char *s, unsigned len) const = 0;
 		virtual Result* oneMismatchFind(const char *s, unsigned len) const = 0;
+		virtual unsigned exactFind(const char *s, unsigned len, std::vector <Hit> &hits, unsigned maxOccurrence = 0) const;
+		virtual unsigned oneMismatchFind(const char *s, unsigned len, std::vector <Hit> &hits, unsigned maxOccurrence = 0) const;
+		/*
+		* Append the hits to a caller-owned buffer instead of allocating a Result list,
+		* so a buffer reused by the caller makes the lookup free of heap allocations.
+		* Keys occurring more than maxOccurrence times (0 means no limit) are skipped, the number of skipped keys is returned
+		*/
+		virtual void exactFind(Lookup *lookups, unsigned count, unsigned len, std::vector <Hit> &hits, unsigned maxOccurrence = 0) const;
+		/*
+		* Looks up many keys of the same length at once, so that a hash can overlap their memory accesses
+		*/
 		virtual void insert(Dna *seq, int start, int end) = 0;
 		virtual void insert(Dna *seq, int start, int end, unsigned long hashValue) = 0;
 		virtual void remove(Dna *seq, int start, int end) = 0;
@@ -83,6 +112,8 @@ class MatchHash : public Hash{
 		MatchHash();
 		~MatchHash();
 		
+		using Hash::exactFind;
+		using Hash::oneMismatchFind;
 		Result* exactFind(const char *s, unsigned len) const;
 		Result* oneMismatchFind(const char *s, unsigned len) const;
 		void insert(Dna *seq, int start, int end);
@@ -91,7 +122,7 @@ class MatchHash : public Hash{
 		virtual void remove(Dna *seq, int start, int end, unsigned long hashValue);
 		
 	private:
-		virtual void find_p(unsigned hashVal, Result *&ret) const = 0;
+		virtual void find_p(unsigned long hashVal, Result *&ret) const = 0;
 		virtual bool insert_p(HashElement *element) = 0;
 		virtual void remove_p(Dna *seq, int start, unsigned long hashValue) = 0;
 };
@@ -118,6 +149,8 @@ class BufferedMatchHash : public Hash{
 		BufferedMatchHash(unsigned hashSize);
 		~BufferedMatchHash();
 		
+		using Hash::exactFind;
+		using Hash::oneMismatchFind;
 		Result* exactFind(const char *s, unsigned len) const;
 		Result* oneMismatchFind(const char *s, unsigned len) const;
 		void insert(Dna *seq, int start, int end);
@@ -146,7 +179,7 @@ class BinaryHash : public MatchHash{
 		
 		unsigned long _binSize, _binAnd, _size;
 		
-		void find_p(unsigned hashVal, Result *&ret) const;
+		void find_p(unsigned long hashVal, Result *&ret) const;
 		bool insert_p(HashElement *element);
 		void remove_p(Dna *seq, int start, unsigned long hashVal);
 };
@@ -165,4 +198,141 @@ class BufferedBinaryHash : public BufferedMatchHash{
 		void insert_p(unsigned elementId);
 };
 
+/*
+* A static hash in compressed-sparse-row form, built in two passes of insert(): the first pass counts the postings of
+* every bucket (finishCounting() then lays out the table), the second pass fills them (finishBuilding() sorts them).
+* Postings of one bucket are contiguous and sorted by the key bits above the bucket bits, which are the only bits stored,
+* then by (seq, start). insert() is thread-safe, so both passes may run on several threads.
+* The occurrence count of a key is the length of its range of postings, so occurrence caps cost no extra storage.
+*/
+class CSRHash : public Hash{
+	public:
+		CSRHash(unsigned binSize, unsigned pieceSize);
+		CSRHash(const char *image);
+		/*
+		* Maps a hash image written by writeImage(), the image must stay valid during the lifetime of the hash
+		*/
+		~CSRHash();
+		
+		static CSRHash *build(ExonList *list, unsigned binSize, unsigned pieceSize, int threadCount = 1, unsigned windowSize = 0);
+		/*
+		* With a window size, only the (windowSize, pieceSize) minimizers of the DNAs are inserted (see MinimizerSampler)
+		*/
+		
+		Result* exactFind(const char *s, unsigned len) const;
+		Result* oneMismatchFind(const char *s, unsigned len) const;
+		unsigned exactFind(const char *s, unsigned len, std::vector <Hit> &hits, unsigned maxOccurrence = 0) const;
+		unsigned oneMismatchFind(const char *s, unsigned len, std::vector <Hit> &hits, unsigned maxOccurrence = 0) const;
+		void exactFind(Lookup *lookups, unsigned count, unsigned len, std::vector <Hit> &hits, unsigned maxOccurrence = 0) const;
+		void insert(Dna *seq, int start, int end);
+		void insert(Dna *seq, int start, int end, unsigned long hashValue);
+		void remove(Dna *seq, int start, int end);
+		void remove(Dna *seq, int start, int end, unsigned long hashValue);
+		
+		const Hit *find(unsigned long hashValue, unsigned long &count) const;
+		/*
+		* The postings of a key, which stay in the hash
+		*/
+		void finishCounting();
+		void finishBuilding(int threadCount = 1);
+		unsigned long imageSize() const;
+		void writeImage(FILE *f) const;
+		
+	private:
+		unsigned *_offsets;				//Postings of bucket b are _postings[_offsets[b]] .. _postings[_offsets[b + 1] - 1]
+		Hit *_postings;
+		unsigned char *_residuals;		//hashValue >> _binSize of every posting, _residualBytes each
+		
+		unsigned long _binSize, _binAnd, _size, _count;
+		unsigned _pieceSize, _residualBytes;
+		bool _isCounting, _isMapped;
+		
+		struct BuildingWork{
+			Dna *dna;
+			int from, to;			//Range of k-mer starts
+			int last;				//Last k-mer start of the DNA
+		};
+		
+		struct BuildingArg{
+			CSRHash *hash;
+			const std::vector <BuildingWork> *works;
+			unsigned long next;
+			unsigned windowSize;
+		};
+		
+		static void *buildingProcess(void *arg);
+		static void *sortingProcess(void *arg);
+		static void runThreads(int threadCount, void *(*process)(void *), BuildingArg *arg);
+		
+		void find_p(unsigned long hashVal, Result *&ret) const;
+		unsigned find_p(unsigned long hashVal, std::vector <Hit> &hits, unsigned maxOccurrence) const;
+		void equalRange_p(unsigned long hashVal, unsigned long &from, unsigned long &to) const;
+		unsigned long residual(unsigned long i) const;
+		void setResidual(unsigned long i, unsigned long value);
+		void sortBuckets_p(unsigned long from, unsigned long to);
+};
+
+/*
+* Finds the keys with one mismatch by the pigeonhole principle: a mismatch leaves either the first or the second half 
+* of a piece exact, so both halves are looked up in a hash of half pieces and the candidates are verified against the 
+* (packed) reference, which takes 2 probes instead of 3 * pieceSize. Exact lookups go to the hash of whole pieces, 
+* which must hold every piece of the reference.
+*/
+class SplitKeyHash : public Hash{
+	public:
+		SplitKeyHash(ExonList *list, const Hash *hash, const CSRHash *halfHash, unsigned pieceSize);
+		~SplitKeyHash();
+		
+		static CSRHash *buildHalfHash(ExonList *list, unsigned binSize, unsigned pieceSize, int threadCount = 1);
+		static unsigned halfSize(unsigned pieceSize);
+		
+		Result* exactFind(const char *s, unsigned len) const;
+		Result* oneMismatchFind(const char *s, unsigned len) const;
+		unsigned exactFind(const char *s, unsigned len, std::vector <Hit> &hits, unsigned maxOccurrence = 0) const;
+		unsigned oneMismatchFind(const char *s, unsigned len, std::vector <Hit> &hits, unsigned maxOccurrence = 0) const;
+		void exactFind(Lookup *lookups, unsigned count, unsigned len, std::vector <Hit> &hits, unsigned maxOccurrence = 0) const;
+		void insert(Dna *seq, int start, int end);
+		void insert(Dna *seq, int start, int end, unsigned long hashValue);
+		void remove(Dna *seq, int start, int end);
+		void remove(Dna *seq, int start, int end, unsigned long hashValue);
+		
+	private:
+		std::vector <const Dna *> _dnas;		//Indexed by id
+		const Hash *_hash;
+		const CSRHash *_halfHash;
+		unsigned _pieceSize, _halfSize;
+		
+		void verify_p(unsigned long hashVal, unsigned long halfHashVal, int shift, std::vector <Hit> &hits) const;
+};
+
+/*
+* Samples the (w, k) minimizers of a sequence: of every w consecutive k-mers, the one with the smallest order is kept
+* (the leftmost one on ties). The order is an invertible mix of the key, so that low-complexity k-mers such as poly-A
+* are not always picked. K-mers with more than 2 'n' are never picked. Two copies of a sequence share the minimizers of
+* every window they share, so the reads and the reference are sampled the same way.
+*/
+class MinimizerSampler{
+	public:
+		MinimizerSampler(unsigned pieceSize, unsigned windowSize);
+		~MinimizerSampler();
+		
+		void sample(const char *s, int size, std::vector <int> &locs);
+		void sample(const Dna *dna, int from, int to, int last, std::vector <int> &locs);
+		/*
+		* Appends the minimizers first picked by windows starting in [from, to], where last is the last k-mer start
+		* of the DNA, so that the minimizers of consecutive ranges are disjoint
+		*/
+		
+	private:
+		std::vector <unsigned long> _orders;
+		std::vector <int> _queue;
+		unsigned long _keyAnd;
+		unsigned _pieceSize, _windowSize;
+		
+		unsigned long order(unsigned long key, int nCount) const;
+		void winnow(int windowCount, int skip, int base, std::vector <int> &locs);
+};
+
+void addToHash(Hash *hash, Dna *dna, int l, int r, int segmentSize);
+
 #endif
@@ -0,0 +1,199 @@
+/*******************************************************************************
+ * This file is part of SAP.
+ * 
+ * SAP is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * SAP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with SAP.  If not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************/
+
+
+
+#include <string.h>
+#include <stdio.h>
+#include <limits.h>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "MatchIndex.h"
+#include "String.h"
+
+/*
+* static functions
+*/
+static inline unsigned long align8(unsigned long x){
+	return (x + 7ULL) & ~7ULL;
+}
+
+static inline void writePadding(FILE *f, unsigned long from, unsigned long to){
+	for (; from < to; from ++) fputc(0, f);
+}
+
+/*
+* Whether [offset, offset + size) lies in a file of fileSize bytes, without overflowing
+*/
+static inline bool isInFile(unsigned long offset, unsigned long size, unsigned long fileSize){
+	return offset <= fileSize && size <= fileSize - offset;
+}
+
+/*
+* MatchIndex
+*/
+MatchIndex::MatchIndex(char *data, unsigned long size) : _data(data), _size(size), _header((const Header *)data){
+	_exonList = new ExonList;
+	const ExonEntry *entries = (const ExonEntry *)(_data + _header -> exonTableOffset);
+	for (unsigned i = 0; i < _header -> exonCount; i ++)
+		_exonList -> addExon(new Exon(entries[i].id, _data + entries[i].nameOffset, (unsigned long *)(_data + entries[i].dnaOffset), 
+									  (unsigned long *)(_data + entries[i].nMaskOffset), entries[i].size));
+	_hash = new CSRHash(_data + _header -> hashOffset);
+	_halfHash = _header -> halfHashOffset ? new CSRHash(_data + _header -> halfHashOffset) : 0;
+}
+
+MatchIndex::~MatchIndex(){
+	delete _hash;
+	delete _halfHash;
+	delete _exonList;
+	munmap(_data, _size);
+}
+
+MatchIndex *MatchIndex::open(const char *fileName){
+	int fd = ::open(fileName, O_RDONLY);
+	if (fd < 0) return 0;
+	struct stat st;
+	if (fstat(fd, &st) || st.st_size < sizeof(Header)){
+		close(fd);
+		return 0;
+	}
+	void *data = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) return 0;
+	
+	if (!isValid_p((const char *)data, st.st_size)){
+		munmap(data, st.st_size);
+		return 0;
+	}
+	return new MatchIndex((char *)data, st.st_size);
+}
+
+/*
+* Every range the constructor follows has to lie in the file, so that a truncated or foreign file is refused here.
+* An exon is at most INT_MAX long, which also keeps its packed sizes from wrapping around
+*/
+bool MatchIndex::isValid_p(const char *data, unsigned long size){
+	const Header *header = (const Header *)data;
+	if (memcmp(header -> magic, MATCH_INDEX_MAGIC, sizeof(header -> magic)) || header -> version != MATCH_INDEX_VERSION || 
+		!isInFile(header -> hashOffset, header -> hashSize, size) || !isInFile(header -> halfHashOffset, header -> halfHashSize, size) || 
+		!isInFile(header -> exonTableOffset, sizeof(ExonEntry) * (unsigned long)header -> exonCount, size) || 
+		(header -> exonTableOffset | header -> hashOffset | header -> halfHashOffset) & 7) return 0;
+	const ExonEntry *entries = (const ExonEntry *)(data + header -> exonTableOffset);
+	for (unsigned i = 0; i < header -> exonCount; i ++){
+		const ExonEntry &entry = entries[i];
+		if (entry.size > INT_MAX || entry.nameOffset >= size || !memchr(data + entry.nameOffset, 0, size - entry.nameOffset) || 
+			!isInFile(entry.dnaOffset, sizeof(unsigned long) * (unsigned long)Dna::packedSize(entry.size), size) || 
+			!isInFile(entry.nMaskOffset, sizeof(unsigned long) * (unsigned long)Dna::nMaskSize(entry.size), size) || 
+			(entry.dnaOffset | entry.nMaskOffset) & 7) return 0;
+	}
+	return 1;
+}
+
+/*
+* File layout: Header, ExonEntry[exonCount], names (each terminated by 0), padding to 8 bytes, 
+* packed DNAs and their 'n' masks (see Dna::pack()), hash image, optional image of the hash of half pieces
+*/
+int MatchIndex::write(const char *fileName, ExonList *list, const CSRHash *hash, int pieceSize, int hashBinarySize, int windowSize, 
+					  const CSRHash *halfHash){
+	FILE *f = fopen(fileName, "wb");
+	if (!f) return -1;
+	
+	Header header;
+	memcpy(header.magic, MATCH_INDEX_MAGIC, sizeof(header.magic));
+	header.version = MATCH_INDEX_VERSION;
+	header.pieceSize = pieceSize;
+	header.hashBinarySize = hashBinarySize;
+	header.exonCount = 0;
+	header.windowSize = windowSize;
+	for (ExonList::iterator it = list -> begin(); !it.isEnd(); it ++) header.exonCount ++;
+	header.exonTableOffset = sizeof(Header);
+	
+	unsigned long nameLoc = header.exonTableOffset + sizeof(ExonEntry) * header.exonCount, loc = nameLoc;
+	for (ExonList::iterator it = list -> begin(); !it.isEnd(); it ++) loc += strlen(it.exon() -> name()) + 1;
+	unsigned long namesEnd = loc;
+	loc = align8(loc);
+	unsigned long dnaLoc = loc;
+	for (ExonList::iterator it = list -> begin(); !it.isEnd(); it ++)
+		loc += sizeof(unsigned long) * (Dna::packedSize(it.exon() -> size()) + Dna::nMaskSize(it.exon() -> size()));
+	header.hashOffset = loc;
+	header.hashSize = hash -> imageSize();
+	header.halfHashOffset = halfHash ? header.hashOffset + header.hashSize : 0;
+	header.halfHashSize = halfHash ? halfHash -> imageSize() : 0;
+	fwrite(&header, sizeof(Header), 1, f);
+	
+	for (ExonList::iterator it = list -> begin(); !it.isEnd(); it ++){
+		Exon *exon = it.exon();
+		ExonEntry entry;
+		entry.id = exon -> id();
+		entry.size = exon -> size();
+		entry.nameOffset = nameLoc;
+		entry.dnaOffset = dnaLoc;
+		entry.nMaskOffset = dnaLoc + sizeof(unsigned long) * Dna::packedSize(exon -> size());
+		nameLoc += strlen(exon -> name()) + 1;
+		dnaLoc = entry.nMaskOffset + sizeof(unsigned long) * Dna::nMaskSize(exon -> size());
+		fwrite(&entry, sizeof(ExonEntry), 1, f);
+	}
+	for (ExonList::iterator it = list -> begin(); !it.isEnd(); it ++) fwrite(it.exon() -> name(), 1, strlen(it.exon() -> name()) + 1, f);
+	writePadding(f, namesEnd, align8(namesEnd));
+	for (ExonList::iterator it = list -> begin(); !it.isEnd(); it ++){
+		Exon *exon = it.exon();
+		unsigned packedSize = Dna::packedSize(exon -> size()), nMaskSize = Dna::nMaskSize(exon -> size());
+		if (exon -> isPacked()){
+			fwrite(exon -> packed(), sizeof(unsigned long), packedSize, f);
+			fwrite(exon -> nMask(), sizeof(unsigned long), nMaskSize, f);
+		}  else {
+			std::vector <unsigned long> packed(packedSize, 0), nMask(nMaskSize, 0);
+			String::packDna(exon -> dna(), exon -> size(), &packed[0], &nMask[0]);
+			fwrite(&packed[0], sizeof(unsigned long), packedSize, f);
+			fwrite(&nMask[0], sizeof(unsigned long), nMaskSize, f);
+		}
+	}
+	hash -> writeImage(f);
+	if (halfHash) halfHash -> writeImage(f);
+	
+	bool failed = ferror(f);
+	if (fclose(f) || failed) return -1;
+	return 0;
+}
+
+ExonList *MatchIndex::exonList() const{
+	return _exonList;
+}
+
+Hash *MatchIndex::hash() const{
+	return _hash;
+}
+
+CSRHash *MatchIndex::halfHash() const{
+	return _halfHash;
+}
+
+int MatchIndex::hashBinarySize() const{
+	return _header -> hashBinarySize;
+}
+
+int MatchIndex::pieceSize() const{
+	return _header -> pieceSize;
+}
+
+int MatchIndex::windowSize() const{
+	return _header -> windowSize;
+}
@@ -0,0 +1,85 @@
+/*******************************************************************************
+ * This file is part of SAP.
+ * 
+ * SAP is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * SAP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with SAP.  If not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************/
+
+
+
+#ifndef MATCHINDEX_H
+#define MATCHINDEX_H
+
+#include "MatchStructures.h"
+#include "MatchHash.h"
+
+#define MATCH_INDEX_MAGIC "SAPINDEX"
+#define MATCH_INDEX_VERSION 5
+
+/*
+* A prebuilt reference index: the exon table and the hash, stored in one file which is memory-mapped read-only,
+* so that several processes on one machine share the same pages
+*/
+class MatchIndex{
+	public:
+		~MatchIndex();
+		
+		static MatchIndex *open(const char *fileName);
+		static int write(const char *fileName, ExonList *list, const CSRHash *hash, int pieceSize, int hashBinarySize, int windowSize, 
+						 const CSRHash *halfHash = 0);
+		/*
+		* The hash of half pieces (see SplitKeyHash) is optional
+		*/
+		
+		ExonList *exonList() const;
+		Hash *hash() const;
+		CSRHash *halfHash() const;
+		int hashBinarySize() const;
+		int pieceSize() const;
+		int windowSize() const;
+		
+	private:
+		struct Header{
+			char magic[8];
+			unsigned version;
+			unsigned pieceSize;
+			unsigned hashBinarySize;
+			unsigned exonCount;
+			unsigned windowSize;		//0 when every k-mer is in the hash, otherwise only the minimizers are
+			unsigned long exonTableOffset;
+			unsigned long hashOffset;
+			unsigned long hashSize;
+			unsigned long halfHashOffset;	//0 when there is no hash of half pieces
+			unsigned long halfHashSize;
+		};
+		
+		struct ExonEntry{
+			int id;
+			unsigned size;
+			unsigned long nameOffset;
+			unsigned long dnaOffset;
+			unsigned long nMaskOffset;
+		};
+		
+		MatchIndex(char *data, unsigned long size);
+		
+		static bool isValid_p(const char *data, unsigned long size);
+		
+		char *_data;
+		unsigned long _size;
+		const Header *_header;
+		ExonList *_exonList;
+		CSRHash *_hash, *_halfHash;
+};
+
+#endif
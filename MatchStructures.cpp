@@ -23,6 +23,7 @@
 #include <map>
 #include <stdio.h>
 #include <stdlib.h>
+#include <algorithm>
 
 #include "IO.h"
 #include "MatchStructures.h"
@@ -57,8 +58,8 @@ static inline int specialDnaToInt(char c){
 	}
 }
 
-static inline unsigned calcHashValue(const char *start, const char *end, int (*funcDnaToInt)(char c) = 0){
-	unsigned ret = 0;
+static inline unsigned long calcHashValue(const char *start, const char *end, int (*funcDnaToInt)(char c) = 0){
+	unsigned long ret = 0;
 	if (funcDnaToInt){
 		for (const char *c = end - 1; c >= start; c --) ret = (ret << 2U) + funcDnaToInt(*c);
 	}  else {
@@ -67,6 +68,12 @@ static inline unsigned calcHashValue(const char *start, const char *end, int (*f
 	return ret;
 }
 
+#ifdef COMPACT_PILEUP
+static inline void addCount(unsigned &count){
+	if (count < MAX_PILEUP_COUNT) count ++;
+}
+
+#endif
 extern "C"{
 	static inline int atomic_exchange(int *dest, int value){
 		int ret;
@@ -80,40 +87,124 @@ extern "C"{
 */
 int Dna::totalDnaCount = 0;
 
-Dna::Dna(const Dna &dna) : _size(dna._size), _id(dna._id){
-	_dna = new char[_size + 1];
-	memcpy(_dna, dna._dna, _size);
-	_dna[_size] = 0;
+Dna::Dna(const Dna &dna) : _size(dna._size), _id(dna._id), _dna(0), _packed(0), _nMask(0), _isMapped(0){
+	if (dna.isPacked()){
+		_packed = new unsigned long[packedSize(_size)];
+		_nMask = new unsigned long[nMaskSize(_size)];
+		memcpy(_packed, dna._packed, sizeof(unsigned long) * packedSize(_size));
+		memcpy(_nMask, dna._nMask, sizeof(unsigned long) * nMaskSize(_size));
+	}  else {
+		_dna = new char[_size + 1];
+		memcpy(_dna, dna._dna, _size);
+		_dna[_size] = 0;
+	}
 }
 
-Dna::Dna(char *dna, int size) : _size(size), _id(totalDnaCount ++){
+Dna::Dna(char *dna, int size) : _size(size), _id(totalDnaCount ++), _packed(0), _nMask(0), _isMapped(0){
 	_dna = new char[_size + 1];
 	memcpy(_dna, dna, _size);
 	_dna[_size] = 0;
 }
 
+Dna::Dna(int id, char *dna, int size) : _size(size), _id(id), _dna(dna), _packed(0), _nMask(0), _isMapped(1){
+	if (totalDnaCount <= id) totalDnaCount = id + 1;
+}
+
+Dna::Dna(int id, unsigned long *packed, unsigned long *nMask, int size) : 
+	_size(size), _id(id), _dna(0), _packed(packed), _nMask(nMask), _isMapped(1){
+		if (totalDnaCount <= id) totalDnaCount = id + 1;
+}
+
 Dna::~Dna(){
-	delete[] _dna;
+	if (!_isMapped){
+		delete[] _dna;
+		delete[] _packed;
+		delete[] _nMask;
+	}
 }
 
 int Dna::id() const{
 	return _id;
 }
 
-unsigned Dna::size() const{
-	return _size;
+int Dna::base(int x) const{
+	return (_packed[x >> 5] >> ((x & 31) << 1)) & 3;
+}
+
+void Dna::copy(int from, int to, char *s) const{
+	if (_dna){
+		memcpy(s, _dna + from, to - from);
+		return;
+	}
+	for (int i = from; i < to; i ++) *(s ++) = isN(i) ? 'n' : dnaString[base(i)];
 }
 
 char *Dna::dna() const{
 	return _dna;
 }
 
+bool Dna::isN(int x) const{
+	return (_nMask[x >> 6] >> (x & 63)) & 1;
+}
+
+bool Dna::isPacked() const{
+	return _packed;
+}
+
+const unsigned long *Dna::nMask() const{
+	return _nMask;
+}
+
+/*
+* Both arrays get one more word than needed, so that word() and nWord() can always read two
+*/
+void Dna::pack(){
+	if (_packed || _isMapped) return;
+	_packed = new unsigned long[packedSize(_size)];
+	_nMask = new unsigned long[nMaskSize(_size)];
+	_packed[packedSize(_size) - 1] = _nMask[nMaskSize(_size) - 1] = 0;
+	String::packDna(_dna, _size, _packed, _nMask);
+	delete[] _dna;
+	_dna = 0;
+}
+
+const unsigned long *Dna::packed() const{
+	return _packed;
+}
+
+unsigned Dna::size() const{
+	return _size;
+}
+
+unsigned long Dna::word(int x) const{
+	const unsigned long *p = _packed + (x >> 5);
+	int shift = (x & 31) << 1;
+	if (!shift) return p[0];
+	return (p[0] >> shift) | (p[1] << (64 - shift));
+}
+
+unsigned long Dna::nWord(int x) const{
+	const unsigned long *p = _nMask + (x >> 6);
+	int shift = x & 63;
+	if (!shift) return p[0];
+	return (p[0] >> shift) | (p[1] << (64 - shift));
+}
+
+unsigned Dna::packedSize(unsigned size){
+	return ((size + 31) >> 5) + 1;
+}
+
+unsigned Dna::nMaskSize(unsigned size){
+	return ((size + 63) >> 6) + 1;
+}
+
 char &Dna::operator[](int x){
 	return _dna[x];
 }
 
 char Dna::operator[](int x) const{
-	return _dna[x];
+	if (_dna) return _dna[x];
+	return isN(x) ? 'n' : dnaString[base(x)];
 }
 
 
@@ -134,8 +225,15 @@ Exon::Exon(char *name, char *dna, int dnaSize) : Dna(dna, dnaSize){
 	_name[len] = 0;
 }
 
+Exon::Exon(int id, char *name, char *dna, int dnaSize) : Dna(id, dna, dnaSize), _name(name){
+}
+
+Exon::Exon(int id, char *name, unsigned long *packed, unsigned long *nMask, int dnaSize) : 
+	Dna(id, packed, nMask, dnaSize), _name(name){
+}
+
 Exon::~Exon(){
-	delete[] _name;
+	if (!_isMapped) delete[] _name;
 }
 
 char* Exon::name() const{
@@ -145,7 +243,7 @@ char* Exon::name() const{
 /*
 * MatchExon
 */
-MatchExon::Insertion::Insertion(char *dna, unsigned short size, double score) : _size(size), _score(score){
+MatchExon::Insertion::Insertion(const char *dna, unsigned short size, double score) : _size(size), _score(score){
 	_dna = new char[_size + 1];
 	memcpy(_dna, dna, _size);
 	_dna[_size] = 0;
@@ -178,8 +276,17 @@ MatchExon::MatchExon(char *name, char *exon, int size): Exon(name, exon, size){
 }
 
 MatchExon::~MatchExon(){
+#ifdef COMPACT_PILEUP
+	delete[] _columns;
+#else
 	delete[] _deletionCount;
 	delete[] _deletionValue;
+	for (int i = 0; i < 4; i ++){
+		delete[] _matchCount[i];
+		delete[] _matchValue[i];
+	}
+	delete[] _totalQ;
+#endif
 	
 	for (int i = 0; i < _size; i ++){
 		Insertion *next;
@@ -190,24 +297,26 @@ MatchExon::~MatchExon(){
 	}
 	delete[] _insertion;
 	
-	for (int i = 0; i < 4; i ++){
-		delete[] _matchCount[i];
-		delete[] _matchValue[i];
-	}
-	delete[] _totalQ;
-	
 	delete[] _lock;
 }
 
 int MatchExon::deleteCount(int loc) const{
+#ifdef COMPACT_PILEUP
+	return _columns[loc].deletionCount;
+#else
 	return _deletionCount[loc];
+#endif
 }
 
 double MatchExon::deleteScore(int loc) const{
+#ifdef COMPACT_PILEUP
+	return _columns[loc].deletionValue;
+#else
 	return _deletionValue[loc];
+#endif
 }
 
-void MatchExon::insert(int loc, char* s, int len, double score){
+void MatchExon::insert(int loc, const char *s, int len, double score){
 	Insertion *insertion = new Insertion(s, len, score);
 	insertion -> _next = _insertion[loc];
 	_insertion[loc] = insertion;
@@ -218,45 +327,106 @@ MatchExon::Insertion *MatchExon::insertion(int loc){
 }
 
 int MatchExon::matchCount(int loc) const{
+#ifdef COMPACT_PILEUP
+	const unsigned *count = _columns[loc].matchCount;
+	return std::min((unsigned long)count[0] + count[1] + count[2] + count[3], (unsigned long)MAX_PILEUP_COUNT);
+#else
 	return _matchCount[0][loc] + _matchCount[1][loc] + _matchCount[2][loc] + _matchCount[3][loc];
+#endif
 }
 
 int MatchExon::matchCount(int loc, char c) const{
 	int v = dnaToInt(c);
 	if (v == -1) return 0.0;
+#ifdef COMPACT_PILEUP
+	return _columns[loc].matchCount[v];
+#else
 	return _matchCount[v][loc];
+#endif
 }
 
 double MatchExon::matchScore(int loc) const{
 	double ret = 0.0;
+#ifdef COMPACT_PILEUP
+	for (int i = 0; i < 4; i ++) ret += _columns[loc].matchValue[i];
+#else
 	for (int i = 0; i < 4; i ++) ret += _matchValue[i][loc];
+#endif
 	return ret;
 }
 
 double MatchExon::matchScore(int loc, char c) const{
 	int v = dnaToInt(c);
 	if (v == -1) return 0.0;
+#ifdef COMPACT_PILEUP
+	return _columns[loc].matchValue[v];
+#else
 	return _matchValue[v][loc];
+#endif
 }
 
 char MatchExon::mostProbableDna(int loc) const{
 	char ret = 'n';
 	double maxValue = -1.0;
 	for (int i = 0; i < 4; i ++){
-		if (_matchValue[i][loc] > maxValue){
-			maxValue = _matchValue[i][loc];
+		if (matchScore(loc, dnaString[i]) > maxValue){
+			maxValue = matchScore(loc, dnaString[i]);
 			ret = dnaString[i];
 		}
 	}
 	return ret;
 }
 
+#ifdef COMPACT_PILEUP
+void MatchExon::updateDeletionValue(int loc, double score, double quality){
+	Column &column = _columns[loc];
+	addCount(column.deletionCount);
+	column.deletionValue += score;
+	column.totalQ += quality;
+}
+
+void MatchExon::updateDeletionValues(int loc, int size, double score, double quality){
+	for (Column *column = _columns + loc; column < _columns + loc + size; column ++){
+		addCount(column -> deletionCount);
+		column -> deletionValue += score;
+		column -> totalQ += quality;
+	}
+}
+
+void MatchExon::updateMatchValue(int loc, char c, double score, double quality){
+	int v = dnaToInt(c);
+	if (v == -1) return;
+	Column &column = _columns[loc];
+	addCount(column.matchCount[v]);
+	column.matchValue[v] += score;
+	column.totalQ += quality;
+}
+
+void MatchExon::updateMatchValues(int loc, const char *s, const double *scores, const double *qualities, int size){
+	Column *column = _columns + loc;
+	for (int i = 0; i < size; i ++){
+		int v = dnaToInt(s[i]);
+		if (v == -1) continue;
+		addCount(column[i].matchCount[v]);
+		column[i].matchValue[v] += scores[i];
+		column[i].totalQ += qualities[i];
+	}
+}
+#else
 void MatchExon::updateDeletionValue(int loc, double score, double quality){
 	_deletionCount[loc] ++;
 	_deletionValue[loc] += score;
 	_totalQ[loc] += quality;
 }
 
+void MatchExon::updateDeletionValues(int loc, int size, double score, double quality){
+	for (int i = loc; i < loc + size; i ++){
+		_deletionCount[i] ++;
+		_deletionValue[i] += score;
+		_totalQ[i] += quality;
+	}
+}
+
 void MatchExon::updateMatchValue(int loc, char c, double score, double quality){
 	int v = dnaToInt(c);
 	if (v == -1) return;
@@ -265,16 +435,28 @@ void MatchExon::updateMatchValue(int loc, char c, double score, double quality){
 	_totalQ[loc] += quality;
 }
 
+void MatchExon::updateMatchValues(int loc, const char *s, const double *scores, const double *qualities, int size){
+	for (int i = 0; i < size; i ++){
+		int v = dnaToInt(s[i]);
+		if (v == -1) continue;
+		_matchCount[v][loc + i] ++;
+		_matchValue[v][loc + i] += scores[i];
+		_totalQ[loc + i] += qualities[i];
+	}
+}
+#endif
+
 void MatchExon::init(){
+#ifdef COMPACT_PILEUP
+	_columns = new Column[_size];
+	memset(_columns, 0, sizeof(Column) * _size);
+#else
 	_deletionCount = new short[_size];
 	memset(_deletionCount, 0, sizeof(short) * _size);
 	
 	_deletionValue = new double[_size];
 	for (int i = 0; i < _size; i ++) _deletionValue[i] = 0.0;
 	
-	_insertion = new Insertion*[_size + 1];
-	memset(_insertion, 0, sizeof(Insertion *) * (_size + 1));
-	
 	_totalQ = new double[_size];
 	for (int i = 0; i < _size; i ++) _totalQ[i] = 0.0;
 	
@@ -284,6 +466,10 @@ void MatchExon::init(){
 		memset(_matchCount[i], 0, sizeof(short) * _size);
 		for (int j = 0; j < _size; j ++) _matchValue[i][j] = 0.0;
 	}
+#endif
+	
+	_insertion = new Insertion*[_size + 1];
+	memset(_insertion, 0, sizeof(Insertion *) * (_size + 1));
 	
 	_lock = new int[(_size >> 6) + 2];
 	memset(_lock, 0, sizeof(int) * ((_size >> 6) + 2));
@@ -294,8 +480,45 @@ void MatchExon::lock(int loc, int len){
 		while (atomic_exchange(_lock + i, 1));
 }
 
+void MatchExon::shift(int count){
+	count = std::min(count, (int)_size);
+	int rest = _size - count;
+	for (int i = 0; i < count; i ++){
+		Insertion *next;
+		for (Insertion *now = _insertion[i]; now; now = next){
+			next = now -> _next;
+			delete now;
+		}
+	}
+	memmove(_insertion, _insertion + count, sizeof(Insertion *) * (rest + 1));
+	memset(_insertion + rest + 1, 0, sizeof(Insertion *) * count);
+	
+	if (_dna) memmove(_dna, _dna + count, rest);
+#ifdef COMPACT_PILEUP
+	memmove(_columns, _columns + count, sizeof(Column) * rest);
+	memset(_columns + rest, 0, sizeof(Column) * count);
+#else
+	memmove(_deletionCount, _deletionCount + count, sizeof(short) * rest);
+	memset(_deletionCount + rest, 0, sizeof(short) * count);
+	memmove(_deletionValue, _deletionValue + count, sizeof(double) * rest);
+	for (int i = rest; i < _size; i ++) _deletionValue[i] = 0.0;
+	memmove(_totalQ, _totalQ + count, sizeof(double) * rest);
+	for (int i = rest; i < _size; i ++) _totalQ[i] = 0.0;
+	for (int j = 0; j < 4; j ++){
+		memmove(_matchCount[j], _matchCount[j] + count, sizeof(short) * rest);
+		memset(_matchCount[j] + rest, 0, sizeof(short) * count);
+		memmove(_matchValue[j], _matchValue[j] + count, sizeof(double) * rest);
+		for (int i = rest; i < _size; i ++) _matchValue[j][i] = 0.0;
+	}
+#endif
+}
+
 double MatchExon::totalQ(int loc) const{
+#ifdef COMPACT_PILEUP
+	return _columns[loc].totalQ;
+#else
 	return _totalQ[loc];
+#endif
 }
 
 void MatchExon::unlock(int loc, int len){
@@ -340,6 +563,11 @@ void ExonList::iterator::operator ++(int){
 ExonList::iterator::iterator(ExonList *parent, const std::map <int, Exon *>::iterator &it) : _parent(parent), _it(it){
 }
 
+void ExonList::addExon(Exon *exon){
+	_infos[exon -> id()] = exon;
+	_totalExonSize += exon -> size();
+}
+
 ExonList::iterator ExonList::begin(){
 	return iterator(this, _infos.begin());
 }
@@ -348,14 +576,15 @@ Exon* ExonList::iterator::exon() const{
 	return _it -> second;
 }
 
-int ExonList::readExon(const char* fileName){
-	IO::BufferedFileReader *reader = IO::BufferedFileReader::newBufferedFileReader(fileName);
+int ExonList::readExon(const char* fileName, bool isPacked){
+	IO::FileReader *reader = IO::newFileReader(fileName);
 	if (!reader -> isOpen()) return -1;
 	DynamicArray <char> bufferName(100), bufferDna(1000);
 	int sizeName, sizeDna;
 	while ((sizeName = reader -> readLine(bufferName) >= 0) && (sizeDna = reader -> readLine(bufferDna)) >= 0){
 		String::toLower(bufferDna.data());
 		Exon *exon = new Exon(bufferName.data(), bufferDna.data(), sizeDna);
+		if (isPacked) exon -> pack();
 		_infos[exon -> id()] = exon;
 		_totalExonSize += exon -> size();
 	}
@@ -364,7 +593,7 @@ int ExonList::readExon(const char* fileName){
 }
 
 int ExonList::readMatchExon(const char* fileName){
-	IO::BufferedFileReader *reader = IO::BufferedFileReader::newBufferedFileReader(fileName);
+	IO::FileReader *reader = IO::newFileReader(fileName);
 	if (!reader -> isOpen()) return -1;
 	DynamicArray <char> bufferName(100), bufferDna(1000);
 	int sizeName, sizeDna;
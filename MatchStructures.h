@@ -30,6 +30,7 @@
 
 #define MIN_INSERTING_LENGTH 9
 #define MIN_SEGMENT_SIZE 3
+#define MAX_PILEUP_COUNT 0x7fffffff
 
 const char dnaString[] = "atgc";
 
@@ -42,19 +43,63 @@ class Dna{
 	public:
 		Dna(const Dna &dna);
 		Dna(char *dna, int size);
+		Dna(int id, char *dna, int size);
+		/*
+		* Wraps an external buffer (e.g. a memory-mapped index) without copying it, the buffer is never freed
+		*/
+		Dna(int id, unsigned long *packed, unsigned long *nMask, int size);
+		/*
+		* Same as above, for a packed buffer (see pack())
+		*/
 		~Dna();
 		
 		int id() const;
+		/*
+		* 2 bits per base as in dnaString, 'n' is 0
+		*/
+		int base(int x) const;
+		/*
+		* Writes the bases of [from, to) as characters into s
+		*/
+		void copy(int from, int to, char *s) const;
+		/*
+		* Returns 0 once the DNA is packed
+		*/
 		char *dna() const;
+		bool isN(int x) const;
+		bool isPacked() const;
+		const unsigned long *nMask() const;
+		/*
+		* Replaces the characters by 2 bits per base (the first base in the lowest bits, the same order as the keys of Hash)
+		* and a mask of 'n', which is 4 times smaller. Other characters than "atgcn" are stored as 'n', mapped DNA is left as it is
+		*/
+		void pack();
+		const unsigned long *packed() const;
 		unsigned size() const;
+		/*
+		* Bases x to x + 31, the first one in the lowest 2 bits
+		*/
+		unsigned long word(int x) const;
+		/*
+		* The 'n' mask of bases x to x + 63, the first one in the lowest bit
+		*/
+		unsigned long nWord(int x) const;
 		
+		/*
+		* Only for DNA which is not packed
+		*/
 		char &operator [](int x);
 		char operator [](int x) const;
 		
+		static unsigned packedSize(unsigned size);
+		static unsigned nMaskSize(unsigned size);
+		
 	protected:
 		int _id;
 		char *_dna;
+		unsigned long *_packed, *_nMask;
 		unsigned _size;
+		bool _isMapped;
 		
 	private:
 		static int totalDnaCount;
@@ -64,6 +109,11 @@ class Exon : public Dna{
 	public:
 		Exon(const Exon &exon);
 		Exon(char *name, char *dna, int dnaSize);
+		Exon(int id, char *name, char *dna, int dnaSize);
+		/*
+		* Wraps external buffers of name and DNA, see Dna(int id, char *dna, int size)
+		*/
+		Exon(int id, char *name, unsigned long *packed, unsigned long *nMask, int dnaSize);
 		~Exon();
 		
 		char *name() const;
@@ -78,7 +128,7 @@ class MatchExon : public Exon{
 			friend class MatchExon;
 			
 			public:
-				Insertion(char *dna, unsigned short size, double score);
+				Insertion(const char *dna, unsigned short size, double score);
 				~Insertion();
 				
 				char *dna() const;
@@ -92,13 +142,26 @@ class MatchExon : public Exon{
 				char *_dna;
 		};
 		
+#ifdef COMPACT_PILEUP
+		struct Column{
+			float matchValue[4];
+			float deletionValue;
+			float totalQ;
+			unsigned matchCount[4];
+			unsigned deletionCount;
+		};
+		/*
+		* Everything updated at a location side by side (built with COMPACT_PILEUP), the counts saturate at MAX_PILEUP_COUNT
+		*/
+		
+#endif
 		MatchExon(const Exon &exon);
 		MatchExon(char *name, char *exon, int size);
 		~MatchExon();
 		
 		int deleteCount(int loc) const;
 		double deleteScore(int loc) const;
-		void insert(int loc, char *s, int len, double score);
+		void insert(int loc, const char *s, int len, double score);
 		Insertion *insertion(int loc);
 		void lock(int loc, int len);
 		int matchCount(int loc) const;
@@ -106,19 +169,32 @@ class MatchExon : public Exon{
 		double matchScore(int loc) const;
 		double matchScore(int loc, char c) const;
 		char mostProbableDna(int loc) const;
+		void shift(int count);
+		/*
+		* Drops the first count columns, the others (and the DNA) move down by count, and the last count columns are left empty
+		*/
 		double totalQ(int loc) const;
 		void unlock(int loc, int len);
 		void updateDeletionValue(int loc, double score, double quality = 0.0);
+		void updateDeletionValues(int loc, int size, double score, double quality = 0.0);
 		void updateMatchValue(int loc, char c, double score, double quality = 0.0);
+		void updateMatchValues(int loc, const char *s, const double *scores, const double *qualities, int size);
+		/*
+		* The size bases from loc on are matched by s, with scores[i] and qualities[i] for s[i]
+		*/
 		
 	private:
+#ifdef COMPACT_PILEUP
+		Column *_columns;
+#else
 		short *_deletionCount;			//Count of deletion happened in every location
 		double *_deletionValue;			//Score of deletion happened in every location
-		Insertion **_insertion;
-		int *_lock;
 		short *_matchCount[4];			//Count of matches
 		double *_matchValue[4];			//Score of match for ATGC (the sum)
 		double *_totalQ;
+#endif
+		Insertion **_insertion;
+		int *_lock;
 		
 		void init();
 };
@@ -145,9 +221,13 @@ class ExonList {
 		ExonList(const std::list <Exon *> &list);
 		~ExonList();
 		
+		void addExon(Exon *exon);
 		iterator begin();
 		iterator exonById(int id);
-		int readExon(const char *fileName);
+		int readExon(const char *fileName, bool isPacked = 0);
+		/*
+		* With isPacked, every exon is packed as soon as it is read (see Dna::pack())
+		*/
 		int readMatchExon(const char *fileName);
 		iterator removeExon(const iterator &it); 
 		int totalExonSize() const;
@@ -21,7 +21,9 @@
 #include "MatchStructures.h"
 #include "IO.h"
 #include "String.h"
+#include "MappingFile.h"
 
+#include <getopt.h>
 #include <stdio.h>
 #include <math.h>
 #include <memory.h>
@@ -35,6 +37,7 @@
 #define DEFAULT_MIN_READ_QUALITY .3
 #define THETA 0.85
 #define ETA 0.03
+#define UNRESOLVED_EXON_ID -2
 
 std::string inputFileName;
 std::string referenceFileName;
@@ -172,108 +175,75 @@ bool processArguments(int argc, char **argv){
 	return 0;
 }
 
-struct mappingInfo{
-	int exonId;
-	double score;
-	std::string mappingString;
-	int strLoc, exonLoc;
-	char isReversed;
-	
-	bool operator < (const mappingInfo &m) const{
-		return score > m.score;
+/*
+* Resolves the reference ids of the input to exon ids once, -1 for a name not in the reference
+*/
+static int exonIdOf(const MappingReader *reader, const std::map <std::string, int> &exonNameToId, std::vector <int> &exonIds, int referenceId){
+	if (referenceId >= (int)exonIds.size()) exonIds.resize(referenceId + 1, UNRESOLVED_EXON_ID);
+	if (exonIds[referenceId] == UNRESOLVED_EXON_ID){
+		const char *name = reader -> referenceName(referenceId);
+		std::map <std::string, int>::const_iterator it = name ? exonNameToId.find(name) : exonNameToId.end();
+		exonIds[referenceId] = (it == exonNameToId.end()) ? -1 : it -> second;
 	}
-};
+	return exonIds[referenceId];
+}
 
 void processMatching(ExonList *exonList, const std::map <std::string, int> &exonNameToId){
-	int dnaLen, bufferLen;
-	DynamicArray <char> dna, buffer, quality;
-	IO::BufferedFileReader *reader = IO::BufferedFileReader::newBufferedFileReader(inputFileName.c_str());
-	std::list <mappingInfo> infos;
-	double maxScore = -1;
-	dnaLen = reader -> readLine(dna);
-	reader -> readLine(quality);
-	if (dnaLen == EOF) return;
+	MappingReader *reader = MappingReader::newMappingReader(inputFileName.c_str());
+	if (!reader){
+		fprintf(stderr, "Cannot read input file: %s.\n", inputFileName.c_str());
+		return;
+	}
+	MappingReader::Record record;
+	DynamicArray <char> quality;
+	std::vector <int> exonIds;
 	int valid = 0, invalid = 0;
-	while ((bufferLen = reader -> readLine(buffer)) != EOF){
-		if (bufferLen == 0){
-			double totalScore = 0.0, totalQuality = 0.0;
-			for (std::list <mappingInfo>::iterator it = infos.begin(); it != infos.end(); it ++)
-				if (it -> exonId != -1 && it -> score >= maxScore * 0.9) totalScore += it -> score;
-			for (unsigned i = 0; i < dnaLen; i ++){
-				if (quality[i] >= 93) quality[i] = 93;
-				quality[i] -= 33;
-				totalQuality += quality[i] / 60.0;
-			}
-			if (1.0 / totalScore * maxScore >= minReadQuality && totalQuality / dnaLen >= minReadQuality){
-				for (std::list <mappingInfo>::iterator it = infos.begin(); it != infos.end(); it ++){
-					if (it -> exonId != -1 && it -> score < maxScore * 0.9) continue;
-					int s = it -> strLoc, e = it -> exonLoc;
-					std::string mappingString = it -> mappingString;
-					ExonList::iterator itx = exonList -> exonById(it -> exonId);
-					if (itx.isEnd()) continue;
-					MatchExon *exon = (MatchExon *)itx.exon();
-					if (it -> isReversed) String::reverseComplement(dna.data(), dnaLen);
-					for (unsigned i = 0; i < mappingString.size(); i ++){
-						if (e >= exon -> size()){
-							//fprintf(stderr, "NO\n");
-							break;
-						}
-						if (mappingString[i] == 'n' || mappingString[i] == 'c'){
-							if (!it -> isReversed) exon -> updateMatchValue(e, dna[s], quality[s] / 60.0);
-							else exon -> updateMatchValue(e, dna[s], quality[dnaLen - s - 1] / 60.0);
-							s ++; e ++;
-						}  else if (mappingString[i] == 'i'){
-							int r = i, sp = s;
-							while (r + 1 < mappingString.size() && mappingString[r + 1] == 'i') r ++, sp ++;
-							if (!it -> isReversed) exon -> insert(e, dna.data() + sp, r - i + 1, quality[s] / 60.0);
-							else exon -> insert(e, dna.data() + sp, r - i + 1, quality[dnaLen - s - 1] / 60.0);
-							i = r;
-							s = sp + 1;
-						}  else {
-							exon -> updateDeletionValue(e, totalQuality / dnaLen);
-							e ++;
-						}  
-					}
-					if (it -> isReversed) String::reverseComplement(dna.data(), dnaLen);
-				}
-				valid ++;
-			}  else {
-				invalid ++;
-			}  
-			infos.clear();
-			dnaLen = reader -> readLine(dna);
-			if (dnaLen == EOF) break;
-			reader -> readLine(quality);
-			maxScore = -1;
-		}  else {
-			mappingInfo info;
-			int lastLoc = 0, matchPlace = 0;
-			for (int i = 0; i < bufferLen; i ++){
-				if (buffer[i] == '\t'){
-					if (matchPlace == 0){
-						buffer[i] = 0;
-						std::map <std::string, int>::const_iterator it = exonNameToId.find(buffer.data() + lastLoc);
-						if (it == exonNameToId.end()) info.exonId = -1;
-						else info.exonId = it -> second;
-					}  else if (matchPlace == 1){
-						if (buffer[lastLoc] == 'N') info.isReversed = 0;
-						else info.isReversed = 1;
-					}  else if (matchPlace == 2){
-						sscanf(buffer.data() + lastLoc, "%d", &info.strLoc);
-					}  else if (matchPlace == 3){
-						sscanf(buffer.data() + lastLoc, "%d", &info.exonLoc);
-					}  else if (matchPlace == 4){
-						sscanf(buffer.data() + lastLoc, "%lf", &info.score);
-						maxScore = std::max(maxScore, info.score);
-					}  
-					matchPlace ++;
-					lastLoc = i + 1;
+	while (reader -> next(record)){
+		char *dna = record.dna;
+		int dnaLen = record.dnaSize;
+		double maxScore = -1, totalScore = 0.0, totalQuality = 0.0;
+		for (int m = 0; m < record.mappingCount; m ++) maxScore = std::max(maxScore, record.mappings[m].score);
+		for (int m = 0; m < record.mappingCount; m ++)
+			if (exonIdOf(reader, exonNameToId, exonIds, record.mappings[m].referenceId) != -1 && record.mappings[m].score >= maxScore * 0.9) 
+				totalScore += record.mappings[m].score;
+		if ((unsigned)dnaLen >= quality.size()) quality.resize(dnaLen + 1);
+		for (int i = 0; i < dnaLen; i ++){
+			quality[i] = record.quality[i];
+			if (quality[i] >= 93) quality[i] = 93;
+			quality[i] -= 33;
+			totalQuality += quality[i] / 60.0;
+		}
+		if (!(1.0 / totalScore * maxScore >= minReadQuality && totalQuality / dnaLen >= minReadQuality)){
+			invalid ++;
+			continue;
+		}
+		for (int m = 0; m < record.mappingCount; m ++){
+			const MappingReader::Mapping &mapping = record.mappings[m];
+			int exonId = exonIdOf(reader, exonNameToId, exonIds, mapping.referenceId);
+			if (exonId != -1 && mapping.score < maxScore * 0.9) continue;
+			int s = mapping.readLoc, e = mapping.referenceLoc;
+			ExonList::iterator itx = exonList -> exonById(exonId);
+			if (itx.isEnd()) continue;
+			MatchExon *exon = (MatchExon *)itx.exon();
+			if (mapping.isReversed) String::reverseComplement(dna, dnaLen);
+			for (int r = mapping.runBegin; r < mapping.runEnd && e < exon -> size(); r ++){
+				const MappingReader::Run &run = record.runs[r];
+				if (run.op == 'n' || run.op == 'c'){
+					for (int k = 0; k < run.length && e < exon -> size(); k ++, s ++, e ++)
+						exon -> updateMatchValue(e, dna[s], (mapping.isReversed ? quality[dnaLen - s - 1] : quality[s]) / 60.0);
+				}  else if (run.op == 'i'){
+					exon -> insert(e, dna + s + run.length - 1, run.length, (mapping.isReversed ? quality[dnaLen - s - 1] : quality[s]) / 60.0);
+					s += run.length;
+				}  else {
+					for (int k = 0; k < run.length && e < exon -> size(); k ++, e ++)
+						exon -> updateDeletionValue(e, totalQuality / dnaLen);
 				}
 			}
-			info.mappingString = (buffer.data() + lastLoc);
-			infos.push_back(info);
+			if (mapping.isReversed) String::reverseComplement(dna, dnaLen);
 		}
+		valid ++;
 	}
+	delete reader;
 	fprintf(stderr, "Valid Reads: %d/%d\n", valid, valid + invalid);
 }
 
@@ -17,6 +17,11 @@
 
 
 
+#include "IO.h"
+#include "String.h"
+#include "DynamicArray.h"
+
+#include <getopt.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -25,6 +30,10 @@
 #define MIN_READ_DEPTH 1
 #define MAX_READ_DEPTH 10000
 #define MAX_SCORE 5.00
+/*
+* Name, location, score and depth are the first 4 tab separated fields of a SNP line
+*/
+#define SNP_TAB_COUNT 3
 
 using namespace std;
 
@@ -95,21 +104,24 @@ int main(int argc, char **argv){
 		showUsage();
 		return 0;
 	}
-	FILE *f = fopen(inputFileName.c_str(), "r");
-	if (!f){
+	IO::FileReader *reader = IO::newFileReader(inputFileName.c_str());
+	if (!reader -> isOpen()){
 		printf("ERROR: cannot open input file.\n");
+		delete reader;
 		return 0;
 	}
 	FILE *fout = fopen(outputFileName.c_str(), "w");
-	char s[1000], name[1000], type[1000];
-	while (fgets(s, 1000, f)){
-		s[strlen(s) - 1] = 0;
-		int depth;
-		double score;
-		sscanf(s, "%s%s%lf%d", name, type, &score, &depth);
-		if (type[0] <= '9' && type[0] >= '0' && score <= maxScore && depth >= minReadDepth && depth <= maxReadDepth) 
-			fprintf(fout, "%s\n", s);
+	DynamicArray <char> line(1000);
+	int size, tabs[SNP_TAB_COUNT];
+	while ((size = reader -> readLine(line)) != EOF){
+		if (String::findChars(line.data(), size, '\t', tabs, SNP_TAB_COUNT) < SNP_TAB_COUNT) continue;
+		char type = line[tabs[0] + 1];
+		double score = atof(line.data() + tabs[1] + 1);
+		int depth = atoi(line.data() + tabs[2] + 1);
+		if (type <= '9' && type >= '0' && score <= maxScore && depth >= minReadDepth && depth <= maxReadDepth) 
+			fprintf(fout, "%s\n", line.data());
 	}
-	fclose(f);
+	fclose(fout);
+	delete reader;
 	return 0;
 }
@@ -18,8 +18,105 @@
 
 
 
+#include <string.h>
+
 #include "String.h"
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+/*
+* Character scanning, compares 16 (SSE2) or 32 (AVX2) chars at a time and walks the movemask bits,
+* the scalar versions are used for the tails and where neither is available
+*/
+typedef const char *(*FindCharFunction)(const char *s, const char *end, char c);
+typedef int (*FindCharsFunction)(const char *s, int size, char c, int *locs, int maxCount);
+
+static const char *findCharScalar(const char *s, const char *end, char c){
+	for (; s < end && *s != c; s ++);
+	return s;
+}
+
+static int findCharsScalar(const char *s, int size, char c, int *locs, int maxCount){
+	int count = 0;
+	for (int i = 0; i < size && count < maxCount; i ++)
+		if (s[i] == c) locs[count ++] = i;
+	return count;
+}
+
+static inline int addLocs(unsigned mask, int base, int *locs, int count, int maxCount){
+	for (; mask && count < maxCount; mask &= mask - 1) locs[count ++] = base + __builtin_ctz(mask);
+	return count;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static const char *findCharSse2(const char *s, const char *end, char c){
+	const __m128i cv = _mm_set1_epi8(c);
+	for (; end - s >= 16; s += 16){
+		unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)s), cv));
+		if (mask) return s + __builtin_ctz(mask);
+	}
+	return findCharScalar(s, end, c);
+}
+
+__attribute__((target("sse2")))
+static int findCharsSse2(const char *s, int size, char c, int *locs, int maxCount){
+	const __m128i cv = _mm_set1_epi8(c);
+	int i = 0, count = 0;
+	for (; i + 16 <= size && count < maxCount; i += 16)
+		count = addLocs(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(s + i)), cv)), i, locs, count, maxCount);
+	if (count >= maxCount) return count;
+	int tail = findCharsScalar(s + i, size - i, c, locs + count, maxCount - count);
+	for (int j = count; j < count + tail; j ++) locs[j] += i;
+	return count + tail;
+}
+
+__attribute__((target("avx2")))
+static const char *findCharAvx2(const char *s, const char *end, char c){
+	const __m256i cv = _mm256_set1_epi8(c);
+	for (; end - s >= 32; s += 32){
+		unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)s), cv));
+		if (mask) return s + __builtin_ctz(mask);
+	}
+	return findCharSse2(s, end, c);
+}
+
+__attribute__((target("avx2")))
+static int findCharsAvx2(const char *s, int size, char c, int *locs, int maxCount){
+	const __m256i cv = _mm256_set1_epi8(c);
+	int i = 0, count = 0;
+	for (; i + 32 <= size && count < maxCount; i += 32)
+		count = addLocs(_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(s + i)), cv)), i, locs, count, maxCount);
+	if (count >= maxCount) return count;
+	int tail = findCharsSse2(s + i, size - i, c, locs + count, maxCount - count);
+	for (int j = count; j < count + tail; j ++) locs[j] += i;
+	return count + tail;
+}
+#endif
+
+static FindCharFunction selectFindChar(){
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) return findCharAvx2;
+	if (__builtin_cpu_supports("sse2")) return findCharSse2;
+#endif
+	return findCharScalar;
+}
+
+static FindCharsFunction selectFindChars(){
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) return findCharsAvx2;
+	if (__builtin_cpu_supports("sse2")) return findCharsSse2;
+#endif
+	return findCharsScalar;
+}
+
+static const FindCharFunction findCharFunction = selectFindChar();
+static const FindCharsFunction findCharsFunction = selectFindChars();
+
 int String::dnaFormat(char *s){
 	int ret = 0;
 	toLower(s);
@@ -52,6 +149,24 @@ bool String::isDna(DynamicArray <char> &s){
 	return 1;
 }
 
+void String::packDna(const char *s, int size, unsigned long *packed, unsigned long *nMask){
+	memset(packed, 0, sizeof(unsigned long) * ((size + 31) >> 5));
+	memset(nMask, 0, sizeof(unsigned long) * ((size + 63) >> 6));
+	for (int i = 0; i < size; i ++){
+		unsigned long c;
+		switch (s[i]){
+			case 'a': c = 0; break;
+			case 't': c = 1; break;
+			case 'g': c = 2; break;
+			case 'c': c = 3; break;
+			default:
+				c = 0;
+				nMask[i >> 6] |= 1UL << (i & 63);
+		}
+		packed[i >> 5] |= c << ((i & 31) << 1);
+	}
+}
+
 void String::reverseComplement(char *s, int size){
 	char *p = s, *q = s + size - 1;
 	for (; p < q; p ++, q --){
@@ -72,3 +187,11 @@ void String::toLower(char *s){
 	for (int i = 0; s[i]; i ++)
 		if (s[i] <= 'Z' && s[i] >= 'A') s[i] = s[i] - 'A' + 'a';
 }
+
+const char *String::findChar(const char *s, const char *end, char c){
+	return findCharFunction(s, end, c);
+}
+
+int String::findChars(const char *s, int size, char c, int *locs, int maxCount){
+	return findCharsFunction(s, size, c, locs, maxCount);
+}
@@ -32,9 +32,24 @@ namespace String{
 	bool isDna(char *s);
 	bool isDna(DynamicArray <char> &s);
 	
+	/*
+	* Packs size bases into (size + 31) / 32 words of 2 bits per base ("atgc" as 0 to 3, the first base in the lowest bits)
+	* and (size + 63) / 64 words of 'n' mask, anything other than "atgc" counts as 'n' and is packed as 0
+	*/
+	void packDna(const char *s, int size, unsigned long *packed, unsigned long *nMask);
+	
 	void reverseComplement(char *s, int size);
 	
 	void toLower(char *s);
+	
+	/*
+	* Returns the first c in [s, end), or end if there is none
+	*/
+	const char *findChar(const char *s, const char *end, char c);
+	/*
+	* Stores the offsets of the first (at most maxCount) c in the size chars from s into locs, returns how many are stored
+	*/
+	int findChars(const char *s, int size, char c, int *locs, int maxCount);
 };
 
 #endif
@@ -0,0 +1,484 @@
+/*******************************************************************************
+ * This file is part of SAP.
+ * 
+ * SAP is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * SAP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with SAP.  If not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************/
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <map>
+#include <set>
+#include <string>
+#include <algorithm>
+
+#include "VariantCaller.h"
+#include "String.h"
+
+#define PR .0001
+
+/*
+* static functions
+*/
+static std::pair <double, double> LogP(double q){
+	double val = pow(10, - q / 10.0);
+	return std::make_pair(log(1.0 - val), log(val));
+}
+
+/*
+* Copies the whole of a temporary file to the end of another file
+*/
+static void appendFile(FILE *to, FILE *from){
+	char buffer[65536];
+	size_t size;
+	rewind(from);
+	while ((size = fread(buffer, 1, sizeof(buffer), from)) > 0) fwrite(buffer, 1, size, to);
+}
+
+/*
+* VariantCaller
+*/
+double VariantCaller::_logCorrect[256], VariantCaller::_logError[256];
+bool VariantCaller::_isPrepared = 0;
+
+bool VariantCaller::ItemKey::operator <(const ItemKey &key) const{
+	if (exonId != key.exonId) return exonId < key.exonId;
+	if (referenceLoc != key.referenceLoc) return referenceLoc < key.referenceLoc;
+	return offset < key.offset;
+}
+
+VariantCaller::VariantCaller(ExonList *exonList, int minValidMatchCount, double minReadQuality, bool isShared, unsigned long memorySize) : 
+	_exonList(exonList), _minValidMatchCount(minValidMatchCount), _minReadQuality(minReadQuality), 
+	_isShared(isShared), _isStreaming(memorySize > 0), _snpCount(0), _deletionCount(0), _insertionCount(0), 
+	_memorySize(memorySize), _itemsSize(0), _itemCount(0), _isRunSorted(1), _maxSpan(0), 
+	_window(0), _windowIt(exonList -> begin()), _windowExon(0), _windowBegin(0){
+}
+
+VariantCaller::~VariantCaller(){
+	for (unsigned i = 0; i < _runFiles.size(); i ++) fclose(_runFiles[i]);
+	delete _window;
+}
+
+VariantCaller *VariantCaller::newVariantCaller(ExonList *exonList, int minValidMatchCount, double minReadQuality, bool isShared){
+	if (!_isPrepared) prepare_p();
+	return new VariantCaller(exonList, minValidMatchCount, minReadQuality, isShared, 0);
+}
+
+VariantCaller *VariantCaller::newStreamingVariantCaller(ExonList *exonList, int minValidMatchCount, double minReadQuality, unsigned long memorySize){
+	if (!_isPrepared) prepare_p();
+	return new VariantCaller(exonList, minValidMatchCount, minReadQuality, 0, std::max(memorySize, 1UL));
+}
+
+bool VariantCaller::addRead(char *dna, const char *quality, int size, const MappingReader::Mapping *mappings, int mappingCount, 
+							const MappingReader::Run *runs, Workspace &workspace){
+	double maxScore = -1, totalQuality = 0.0;
+	for (int m = 0; m < mappingCount; m ++) maxScore = std::max(maxScore, mappings[m].score);
+	workspace.quality[0].resize(size + 1);
+	workspace.quality[1].resize(size + 1);
+	for (int i = 0; i < size; i ++){
+		char q = quality[i];
+		if (q >= 93) q = 93;
+		q -= 33;
+		if (q <= 0) q = 1;
+		workspace.quality[0][i] = workspace.quality[1][size - i - 1] = q;
+		totalQuality += q;
+	}
+	if (!(totalQuality / size >= _minReadQuality)) return 0;
+	
+	if (!_isStreaming){
+		for (int strand = 0; strand < 2; strand ++){
+			workspace.matchScores[strand].resize(size + 1);
+			workspace.matchQualities[strand].resize(size + 1);
+			for (int i = 0; i < size; i ++){
+				int q = workspace.quality[strand][i];
+				workspace.matchScores[strand][i] = _logCorrect[q] - _logError[q];
+				workspace.matchQualities[strand][i] = _logError[q];
+			}
+		}
+	}
+	for (int m = 0; m < mappingCount; m ++){
+		const MappingReader::Mapping &mapping = mappings[m];
+		if (mapping.referenceId == -1 || mapping.referenceLoc < 0 || mapping.score < maxScore * BEST_MAPPING_RATIO) continue;
+		ExonList::iterator itx = _exonList -> exonById(mapping.referenceId);
+		if (itx.isEnd()) continue;
+		
+		int strand = mapping.isReversed, s = std::min(mapping.readLoc, size), span = 0;
+		const MappingReader::Run *mappingRuns = runs + mapping.runBegin;
+		int runCount = mapping.runEnd - mapping.runBegin;
+		if (mapping.isReversed) String::reverseComplement(dna, size);
+		if (_isStreaming) addItem_p(mapping, dna, workspace.quality[strand].data(), size, runs);
+		else {
+			MatchExon *exon = (MatchExon *)itx.exon();
+			if (_isShared){
+				for (int r = 0; r < runCount; r ++)
+					if (mappingRuns[r].op != 'i') span += mappingRuns[r].length;
+				span = std::max(0, std::min(span, (int) exon -> size() - mapping.referenceLoc));
+				exon -> lock(mapping.referenceLoc, span);
+			}
+			pileUp_p(exon, mapping.referenceLoc, exon -> size(), dna + s, &workspace.quality[strand][s], 
+					 &workspace.matchScores[strand][s], &workspace.matchQualities[strand][s], size - s, mappingRuns, runCount);
+			if (_isShared) exon -> unlock(mapping.referenceLoc, span);
+		}
+		if (mapping.isReversed) String::reverseComplement(dna, size);
+	}
+	return 1;
+}
+
+bool VariantCaller::call(const char *fileName){
+	FILE *fout = fopen(fileName, "w");
+	if (!fout) return 0;
+	
+	bool ret = 1;
+	if (_isStreaming) ret = streamCall_p(fout);
+	else {
+		for (ExonList::iterator it = _exonList -> begin(); !it.isEnd(); it ++){
+			MatchExon *exon = (MatchExon *)it.exon();
+			callSnps_p(fout, exon -> name(), exon, 0, 0, exon -> size());
+		}
+		for (ExonList::iterator it = _exonList -> begin(); !it.isEnd(); it ++){
+			MatchExon *exon = (MatchExon *)it.exon();
+			callDeletions_p(fout, exon -> name(), exon, 0, 0, exon -> size());
+		}
+		for (ExonList::iterator it = _exonList -> begin(); !it.isEnd(); it ++){
+			MatchExon *exon = (MatchExon *)it.exon();
+			callInsertions_p(fout, exon -> name(), exon, 0, 0, exon -> size(), exon -> size());
+		}
+	}
+	fclose(fout);
+	fprintf(stderr, "Found SNP:%d, Deletion:%d, Insertion:%d\n", _snpCount, _deletionCount, _insertionCount);
+	return ret;
+}
+
+/*
+* Keeps the part of the read that the mapping covers, and the quality of the next base for a deletion at its end
+*/
+void VariantCaller::addItem_p(const MappingReader::Mapping &mapping, const char *dna, const char *quality, int size, const MappingReader::Run *runs){
+	int runCount = mapping.runEnd - mapping.runBegin, span = 0, length = 0;
+	runs += mapping.runBegin;
+	for (int r = 0; r < runCount; r ++){
+		if (runs[r].op != 'i') span += runs[r].length;
+		if (runs[r].op != 'd') length += runs[r].length;
+	}
+	int readLoc = std::min(mapping.readLoc, size);
+	length = std::min(length + 1, size - readLoc);
+	
+	Item item = {mapping.referenceId, mapping.referenceLoc, length, runCount};
+	unsigned itemSize = itemSize_p(&item);
+	if (_itemsSize && _itemsSize + itemSize + sizeof(ItemKey) * (_itemKeys.size() + 1) > _memorySize) spillRun_p();
+	if (_itemsSize + itemSize > _items.size()) _items.resize(std::max(_itemsSize + itemSize, (unsigned long)_items.size() << 1));
+	
+	char *s = &_items[_itemsSize];
+	memcpy(s, &item, sizeof(Item));
+	memcpy(s + sizeof(Item), runs, sizeof(MappingReader::Run) * runCount);
+	s += sizeof(Item) + sizeof(MappingReader::Run) * runCount;
+	memcpy(s, dna + readLoc, length);
+	memcpy(s + length, quality + readLoc, length);
+	
+	ItemKey key = {mapping.referenceId, mapping.referenceLoc, _itemsSize};
+	if (!_itemKeys.empty() && key < _itemKeys.back()) _isRunSorted = 0;
+	_itemKeys.push_back(key);
+	_itemsSize += itemSize;
+	_itemCount ++;
+	_maxSpan = std::max(_maxSpan, span);
+}
+
+/*
+* Calls the columns before loc, which no later mapping reaches, and slides the window to begin at loc.
+* A column is called only while the next one is in the window, for the insertions
+*/
+void VariantCaller::advanceWindow_p(int loc, FILE *fout, FILE *deletions, FILE *insertions){
+	int windowSize = _window -> size(), exonSize = _windowExon -> size();
+	while (_windowBegin < loc){
+		int count = std::min(loc - _windowBegin, windowSize - 1);
+		int to = std::min(count, exonSize - _windowBegin);
+		if (to > 0){
+			callSnps_p(fout, _windowExon -> name(), _window, _windowBegin, 0, to);
+			callDeletions_p(deletions, _windowExon -> name(), _window, _windowBegin, 0, to);
+			callInsertions_p(insertions, _windowExon -> name(), _window, _windowBegin, 0, to, exonSize - _windowBegin);
+		}
+		_window -> shift(count);
+		_windowBegin += count;
+		
+		int from = windowSize - count, end = std::max(from, std::min(windowSize, exonSize - _windowBegin));
+		_windowExon -> copy(_windowBegin + from, _windowBegin + end, _window -> dna() + from);
+		memset(_window -> dna() + end, 'n', windowSize - end);
+	}
+}
+
+void VariantCaller::callDeletions_p(FILE *fout, const char *name, MatchExon *pileup, int offset, int from, int to){
+	for (int i = from; i < to; i ++){
+		double ms = pileup -> matchScore(i) + pileup -> totalQ(i), ds = pileup -> deleteScore(i) + pileup -> totalQ(i);
+		if (pileup -> deleteCount(i) >= _minValidMatchCount && ds >= ms){
+			fprintf(fout, "%s\tDEL\t%d\t%d\t%.3lf\t%.3lf\n", name + 1, offset + i, pileup -> deleteCount(i), ds, ms);
+			_deletionCount ++;
+		}
+	}
+}
+
+/*
+* end is the end of the exon, relative to the pileup as from and to
+*/
+void VariantCaller::callInsertions_p(FILE *fout, const char *name, MatchExon *pileup, int offset, int from, int to, int end){
+	for (int i = from; i < to; i ++){
+		int total = 0, len = -1;
+		double totalScore = 0.0;
+		std::map <int, double> scores;
+		std::map <std::string, double> insertion;
+		for (MatchExon::Insertion *ins = pileup -> insertion(i); ins; ins = ins -> next()){
+			insertion[ins -> dna()] += ins -> score();
+			totalScore += ins -> score();
+			scores[strlen(ins -> dna())] += ins -> score();
+			total ++;
+		}
+		
+		double scoreNear = pileup -> matchScore(i) + pileup -> totalQ(i);
+		if (i + 1 < end) scoreNear = std::min(scoreNear, pileup -> matchScore(i + 1) + pileup -> totalQ(i + 1));
+		if (total >= _minValidMatchCount && totalScore >= scoreNear){
+			for (std::map <int, double>::iterator it = scores.begin(); it != scores.end(); it ++)
+				if (len == -1 || it -> second > scores[len]) len = it -> first;
+			fprintf(fout, "%s\tINS\t%d\t%d\t%.3lf\t%.3lf\tCHG=", name + 1, offset + i, total, totalScore, scoreNear);
+			for (std::map <std::string, double>::iterator it = insertion.begin(); it != insertion.end(); it ++)
+				fprintf(fout, "%s(%.3lf) ", it -> first.c_str(), it -> second);
+			fprintf(fout, "\n");
+			_insertionCount ++;
+		}
+	}
+}
+
+void VariantCaller::callSnps_p(FILE *fout, const char *name, MatchExon *pileup, int offset, int from, int to){
+	const Dna &reference = *pileup;
+	for (int i = from; i < to; i ++){
+		if (pileup -> matchCount(i) < _minValidMatchCount) continue;
+		std::vector <std::pair <double, int> > score;
+		for (int j = 0; j < 4; j ++)
+			if (pileup -> matchCount(i, dnaString[j]) > 0)
+				score.push_back(std::make_pair(- pileup -> matchCount(i, dnaString[j]), j));
+		std::sort(score.begin(), score.end());
+		if (score.size() == 0) continue;
+		char co = reference[i];
+		int c1 = dnaString[score[0].second], c2 = -1;
+		double tc = 0.0;
+		if (score.size() >= 2){
+			c2 = dnaString[score[1].second];
+			int count1 = - score[0].first, count2 = - score[1].first;
+			int sum = - score[0].first - score[1].first;
+			double pp1 = pileup -> matchScore(i, c1) + pileup -> totalQ(i);
+			double pp2 = pileup -> matchScore(i, c2) + pileup -> totalQ(i);
+			double pp3 = lgamma(sum + 1) - lgamma(count1 + 1) - lgamma(count2 + 1) + log(.5) * (sum);
+			double div = log(PR * exp(pp3) + (1.0 - PR) / 2.0 * (exp(pp1) + exp(pp2)));
+			double p1 = pp1 + log((1.0 - PR) / 2.0) - div;
+			double p2 = pp2 + log((1.0 - PR) / 2.0) - div;
+			double p3 = log(PR) + pp3;
+			if (p1 >= p2 && p1 >= p3){
+				c2 = -1;
+				tc = fabs(p1 * p1 / p2 / p3);
+			}  else if (p2 >= p1 && p2 >= p3){
+				c1 = c2, c2 = -1;
+				tc = fabs(p2 * p2 / p1 / p3);
+			}  else tc = fabs(p3 * p3 / p1 / p2);
+		} 
+		if (c2 == -1){
+			int cur = c1;
+			if (co != cur){
+				fprintf(fout, "%s\t%d\t%.3lf\t%d\t%d\t%c\t%c\n", name + 1, offset + i, 
+						tc * 1000.0, pileup -> matchCount(i, cur), pileup -> matchCount(i),
+						co, cur);
+				_snpCount ++;
+			}
+		}  else {
+			fprintf(fout, "%s\t%d\t%.3lf\t%d\t%d\t%c\t%c%c\n", name + 1, offset + i, 
+					tc * 1000.0, pileup -> matchCount(i, c1) + pileup -> matchCount(i, c2), pileup -> matchCount(i),
+					co, c1, c2);
+			_snpCount ++;
+		}  
+	}
+}
+
+/*
+* Calls what is left of the exon in the window, and moves the window to the beginning of the next exon
+*/
+void VariantCaller::nextExon_p(FILE *fout, FILE *deletions, FILE *insertions){
+	advanceWindow_p(_windowExon -> size(), fout, deletions, insertions);
+	_windowIt ++;
+	resetWindow_p();
+}
+
+/*
+* The runs of the mapping, as the bases dna[0 .. size - 1] of the read, are piled up from column e of the exon on, and never reach limit
+*/
+void VariantCaller::pileUp_p(MatchExon *exon, int e, int limit, const char *dna, const char *quality, const double *scores, const double *qualities, 
+							 int size, const MappingReader::Run *runs, int runCount){
+	int s = 0;
+	for (int r = 0; r < runCount && e < limit; r ++){
+		const MappingReader::Run &run = runs[r];
+		if (run.op == 'n' || run.op == 'c'){
+			int length = std::min(run.length, limit - e);
+			exon -> updateMatchValues(e, dna + s, scores + s, qualities + s, length);
+			s += length;
+			e += length;
+		}  else if (run.op == 'i'){
+			double totalQ = 0.0;
+			for (int k = 0; k < run.length; k ++) totalQ += quality[s + k];
+			exon -> insert(e, dna + s, run.length, LogP(totalQ / run.length).first);
+			s += run.length;
+		}  else {
+			int q = quality[std::max(0, std::min(s, size - 1))];
+			int length = std::min(run.length, limit - e);
+			exon -> updateDeletionValues(e, length, _logCorrect[q] - _logError[q], _logError[q]);
+			e += length;
+		}
+	}
+}
+
+void VariantCaller::pileUpItem_p(const Item *item, FILE *fout, FILE *deletions, FILE *insertions){
+	while (_windowExon -> id() != item -> exonId) nextExon_p(fout, deletions, insertions);
+	
+	const MappingReader::Run *runs = (const MappingReader::Run *)(item + 1);
+	const char *dna = (const char *)(runs + item -> runCount), *quality = dna + item -> size;
+	int span = 0, windowSize = _window -> size();
+	for (int r = 0; r < item -> runCount; r ++)
+		if (runs[r].op != 'i') span += runs[r].length;
+	if (item -> referenceLoc + span + 1 >= _windowBegin + windowSize) advanceWindow_p(item -> referenceLoc - 1, fout, deletions, insertions);
+	
+	std::vector <double> &scores = _workspace.matchScores[0], &qualities = _workspace.matchQualities[0];
+	scores.resize(item -> size + 1);
+	qualities.resize(item -> size + 1);
+	for (int i = 0; i < item -> size; i ++){
+		int q = quality[i];
+		scores[i] = _logCorrect[q] - _logError[q];
+		qualities[i] = _logError[q];
+	}
+	pileUp_p(_window, item -> referenceLoc - _windowBegin, std::min(windowSize, (int) _windowExon -> size() - _windowBegin), 
+			 dna, quality, scores.data(), qualities.data(), item -> size, runs, item -> runCount);
+}
+
+bool VariantCaller::readItem_p(FILE *f, std::vector <char> &item){
+	if (item.size() < sizeof(Item)) item.resize(sizeof(Item));
+	if (fread(item.data(), sizeof(Item), 1, f) != 1) return 0;
+	unsigned itemSize = itemSize_p((const Item *)item.data());
+	if (item.size() < itemSize) item.resize(itemSize);
+	return fread(item.data() + sizeof(Item), itemSize - sizeof(Item), 1, f) == 1;
+}
+
+/*
+* Empties the window and fills it with the beginning of the current exon
+*/
+void VariantCaller::resetWindow_p(){
+	int windowSize = _window -> size();
+	_windowExon = _windowIt.isEnd() ? 0 : _windowIt.exon();
+	_windowBegin = 0;
+	_window -> shift(windowSize);
+	if (!_windowExon) return;
+	int end = std::min(windowSize, (int) _windowExon -> size());
+	_windowExon -> copy(0, end, _window -> dna());
+	memset(_window -> dna() + end, 'n', windowSize - end);
+}
+
+/*
+* Writes the items gathered so far to a temporary file, in coordinate order
+*/
+void VariantCaller::spillRun_p(){
+	FILE *f = tmpfile();
+	if (!f){
+		fprintf(stderr, "Cannot create a temporary file to sort the mappings.\n");
+		exit(1);
+	}
+	sortRun_p();
+	for (unsigned i = 0; i < _itemKeys.size(); i ++){
+		const Item *item = (const Item *)&_items[_itemKeys[i].offset];
+		if (fwrite(item, itemSize_p(item), 1, f) != 1){
+			fprintf(stderr, "Cannot write a temporary file to sort the mappings.\n");
+			exit(1);
+		}
+	}
+	_runFiles.push_back(f);
+	_itemKeys.clear();
+	_itemsSize = 0;
+	_isRunSorted = 1;
+}
+
+void VariantCaller::sortRun_p(){
+	if (!_isRunSorted) std::sort(_itemKeys.begin(), _itemKeys.end());
+	_isRunSorted = 1;
+}
+
+/*
+* Merges the sorted runs (the items equal in coordinate stay in the order of the input), and slides the window along every exon.
+* The SNPs are written as they are called, the deletions and insertions wait in temporary files to keep the order of the output
+*/
+bool VariantCaller::streamCall_p(FILE *fout){
+	FILE *deletions = tmpfile(), *insertions = tmpfile();
+	if (!deletions || !insertions){
+		if (deletions) fclose(deletions);
+		if (insertions) fclose(insertions);
+		return 0;
+	}
+	
+	int windowSize = std::max(STREAM_WINDOW_SIZE, (_maxSpan + 2) << 1);
+	std::vector <char> windowDna(windowSize, 'n');
+	char windowName[] = ">";
+	_window = new MatchExon(windowName, windowDna.data(), windowSize);
+	_windowIt = _exonList -> begin();
+	resetWindow_p();
+	
+	if (_runFiles.empty()){
+		sortRun_p();
+		for (unsigned i = 0; i < _itemKeys.size(); i ++)
+			pileUpItem_p((const Item *)&_items[_itemKeys[i].offset], fout, deletions, insertions);
+	}  else {
+		spillRun_p();
+		std::vector <std::vector <char> > items(_runFiles.size());
+		std::set <ItemKey> heads;
+		for (unsigned i = 0; i < _runFiles.size(); i ++){
+			rewind(_runFiles[i]);
+			if (!readItem_p(_runFiles[i], items[i])) continue;
+			const Item *item = (const Item *)items[i].data();
+			ItemKey key = {item -> exonId, item -> referenceLoc, i};
+			heads.insert(key);
+		}
+		while (!heads.empty()){
+			unsigned i = heads.begin() -> offset;
+			heads.erase(heads.begin());
+			pileUpItem_p((const Item *)items[i].data(), fout, deletions, insertions);
+			if (!readItem_p(_runFiles[i], items[i])) continue;
+			const Item *item = (const Item *)items[i].data();
+			ItemKey key = {item -> exonId, item -> referenceLoc, i};
+			heads.insert(key);
+		}
+	}
+	while (_windowExon) nextExon_p(fout, deletions, insertions);
+	fprintf(stderr, "Mappings sorted: %lu in %lu run(s), window of %d columns\n", _itemCount, std::max(_runFiles.size(), (size_t)1), windowSize);
+	
+	appendFile(fout, deletions);
+	appendFile(fout, insertions);
+	fclose(deletions);
+	fclose(insertions);
+	return 1;
+}
+
+unsigned VariantCaller::itemSize_p(const Item *item){
+	unsigned size = sizeof(Item) + sizeof(MappingReader::Run) * item -> runCount + (item -> size << 1);
+	return (size + 3) & ~3U;
+}
+
+void VariantCaller::prepare_p(){
+	for (int i = 0; i < 256; i ++){
+		_logCorrect[i] = LogP(i).first;
+		_logError[i] = LogP(i).second;
+	}
+	_isPrepared = 1;
+}
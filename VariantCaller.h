@@ -0,0 +1,136 @@
+/*******************************************************************************
+ * This file is part of SAP.
+ * 
+ * SAP is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * SAP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with SAP.  If not, see <http://www.gnu.org/licenses/>.
+ ******************************************************************************/
+
+
+
+#ifndef VARIANTCALLER_H
+#define VARIANTCALLER_H
+
+#include <stdio.h>
+#include <vector>
+
+#include "DynamicArray.h"
+#include "MatchStructures.h"
+#include "MappingFile.h"
+
+#define DEFAULT_MIN_VALID_MATCH_COUNT 5
+#define DEFAULT_MIN_READ_QUALITY .3
+#define DEFAULT_SORT_MEMORY 1024
+#define BEST_MAPPING_RATIO 0.9
+#define STREAM_WINDOW_SIZE 65536
+
+/*
+* Piles the mappings of reads up on the MatchExon of their references, and calls SNPs, deletions and insertions out of the pileups.
+* Predictor feeds it with the mappings of a Mapper output, Mapper --call with the mappings as they are found.
+* In streaming mode the mappings are sorted by coordinate instead (on disk when they exceed the memory budget),
+* and piled up in a window of columns sliding along every exon, so the pileups of the whole reference never exist at once
+*/
+class VariantCaller{
+	public:
+		struct Workspace{
+			std::vector <char> quality[2];
+			std::vector <double> matchScores[2], matchQualities[2];
+		};
+		/*
+		* Scratch memory of one thread adding reads, everything is kept for both strands of the read
+		*/
+		
+		~VariantCaller();
+		
+		static VariantCaller *newVariantCaller(ExonList *exonList, int minValidMatchCount, double minReadQuality, bool isShared);
+		/*
+		* Every exon of the list is a MatchExon, which is updated in place. With isShared reads may be added by several threads at once
+		*/
+		static VariantCaller *newStreamingVariantCaller(ExonList *exonList, int minValidMatchCount, double minReadQuality, unsigned long memorySize);
+		/*
+		* The exons of the list are plain (not packed) Exon. At most memorySize bytes of mappings are sorted in memory, 
+		* the others are sorted in runs written to temporary files
+		*/
+		bool addRead(char *dna, const char *quality, int size, const MappingReader::Mapping *mappings, int mappingCount, 
+					 const MappingReader::Run *runs, Workspace &workspace);
+		/*
+		* The referenceId of a mapping is the id of its exon in the list, -1 when the reference is not in the list.
+		* Only the mappings scoring at least BEST_MAPPING_RATIO of the best one of the read are piled up.
+		* The DNA is restored before returning. Returns 0 when the read is dropped for its quality
+		*/
+		bool call(const char *fileName);
+		/*
+		* Writes the calls of every exon, SNPs first, then deletions and insertions. Returns 0 when a file cannot be opened
+		*/
+		
+	private:
+		struct Item{
+			int exonId, referenceLoc;
+			int size, runCount;
+		};
+		/*
+		* A mapping waiting for the coordinate sort, followed by its runs, then by the DNA and the qualities 
+		* of the part of the read it covers, both on the strand of the reference
+		*/
+		
+		struct ItemKey{
+			int exonId, referenceLoc;
+			unsigned long offset;
+			
+			bool operator <(const ItemKey &key) const;
+		};
+		
+		VariantCaller(ExonList *exonList, int minValidMatchCount, double minReadQuality, bool isShared, unsigned long memorySize);
+		
+		ExonList *_exonList;
+		int _minValidMatchCount;
+		double _minReadQuality;
+		bool _isShared, _isStreaming;
+		int _snpCount, _deletionCount, _insertionCount;
+		
+		//Streaming mode
+		unsigned long _memorySize;
+		std::vector <char> _items;			//Items of the run being gathered
+		unsigned long _itemsSize, _itemCount;
+		std::vector <ItemKey> _itemKeys;
+		bool _isRunSorted;
+		std::vector <FILE *> _runFiles;		//Sorted runs written out
+		int _maxSpan;
+		MatchExon *_window;					//Columns _windowBegin to _windowBegin + window size - 1 of the current exon
+		ExonList::iterator _windowIt;
+		Exon *_windowExon;
+		int _windowBegin;
+		Workspace _workspace;
+		
+		static double _logCorrect[256], _logError[256];			//log(1 - e) and log(e) of the error rate e of every quality
+		static bool _isPrepared;
+		
+		void addItem_p(const MappingReader::Mapping &mapping, const char *dna, const char *quality, int size, const MappingReader::Run *runs);
+		void advanceWindow_p(int loc, FILE *fout, FILE *deletions, FILE *insertions);
+		void callDeletions_p(FILE *fout, const char *name, MatchExon *pileup, int offset, int from, int to);
+		void callInsertions_p(FILE *fout, const char *name, MatchExon *pileup, int offset, int from, int to, int end);
+		void callSnps_p(FILE *fout, const char *name, MatchExon *pileup, int offset, int from, int to);
+		void nextExon_p(FILE *fout, FILE *deletions, FILE *insertions);
+		void pileUp_p(MatchExon *exon, int e, int limit, const char *dna, const char *quality, const double *scores, const double *qualities, 
+					  int size, const MappingReader::Run *runs, int runCount);
+		void pileUpItem_p(const Item *item, FILE *fout, FILE *deletions, FILE *insertions);
+		bool readItem_p(FILE *f, std::vector <char> &item);
+		void resetWindow_p();
+		void spillRun_p();
+		void sortRun_p();
+		bool streamCall_p(FILE *fout);
+		
+		static unsigned itemSize_p(const Item *item);
+		static void prepare_p();
+};
+
+#endif
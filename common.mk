@@ -22,6 +22,9 @@ ifeq (${COPT},)
 endif
 CFLAGS=-g
 HG_DEFS=-DMACHTYPE_${MACHTYPE}
+ifneq (${COMPACT_PILEUP},)
+    HG_DEFS += -DCOMPACT_PILEUP
+endif
 HG_WARN=-Wformat -Wimplicit -Wuninitialized -Wreturn-type
 
 ifeq (${BINDIR},)